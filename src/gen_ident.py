@@ -1,26 +1,45 @@
-"""Convert HP Omen devicelist json to a id struct"""
+"""Convert the HP Omen board list json to the driver's board capability table"""
 import json
+import sys
 
-def gen_device_list(devices):
-  print("static const struct dmi_system_id omen_quirks[] __initconst = {")
+THERMAL_VARIANTS = ("generic", "omen")
+
+# A capability left out of an entry is unknown: the flag stays set and the
+# driver probes for it. Only an explicit false rules it out.
+def board_flags(dev):
+  flags = []
+  if dev.get("FourZone", True):
+    flags.append("HPWMI_BOARD_FOURZONE")
+  if dev.get("GM", True):
+    flags.append("HPWMI_BOARD_GM")
+  if dev["ThermalProfile"] not in THERMAL_VARIANTS:
+    raise ValueError("{}: unknown ThermalProfile {}".format(dev["DisplayName"], dev["ThermalProfile"]))
+  if dev["ThermalProfile"] == "omen":
+    flags.append("HPWMI_BOARD_OMEN_THERMAL")
+  return " | ".join(flags) or "0"
+
+def gen_board_table(devices, out):
+  boards = {}
   for dev in devices:
     for board in dev["ProductNum"]:
-      print("""  {{
-    .callback = dmi_matched,
-    .ident = "{}",
-    .matches = {{
-      DMI_EXACT_MATCH(DMI_BOARD_NAME, "{}"),
-      }},
-    .driver_data = {},
-  }},""".format(dev["DisplayName"], board, dev["BackgroundFeature"]))
-  print("  {}\n};\n")
+      if board in boards:
+        raise ValueError("board {} listed twice".format(board))
+      boards[board] = (dev["DisplayName"], board_flags(dev), dev.get("FanCount", 0))
 
-if __name__ == "__main__":
-  devicelist = []
+  # sorted by name for bsearch() in hp_wmi_board_lookup()
+  out.write("static const struct hp_wmi_board hp_wmi_boards[] = {\n")
+  for board in sorted(boards):
+    name, flags, fans = boards[board]
+    out.write("  {{ \"{}\", {}, {} }}, /* {} */\n".format(board, flags, fans, name))
+  out.write("};\n")
 
-  with open("omen_cs/HP.Omen.DeviceLib.JSON.DeviceList.json", "r") as f:
+if __name__ == "__main__":
+  src = sys.argv[1] if len(sys.argv) > 1 else "boards.json"
+  with open(src, "r") as f:
     devicelist = json.load(f)
-    print("// ident.h")
-    print("// generated by gen_ident.py from HP.Omen.DeviceLib.JSON.DeviceList.json\n")
-    gen_device_list(devicelist)
 
+  out = open(sys.argv[2], "w") if len(sys.argv) > 2 else sys.stdout
+  with out:
+    out.write("/* SPDX-License-Identifier: GPL-2.0-or-later */\n")
+    out.write("/* hp-wmi-boards.h, generated by gen_ident.py from boards.json - do not edit */\n\n")
+    gen_board_table(devicelist, out)
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * Userspace interface of the HP WMI driver
+ */
+
+#ifndef _HP_WMI_IOCTL_H
+#define _HP_WMI_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * /dev/hp-wmi-events: every raw WMI event is delivered as one record. A
+ * read() returns as many whole records as fit in the buffer; poll() reports
+ * EPOLLIN while at least one record is queued.
+ */
+struct hp_wmi_event_record {
+	__u32 id;		/* WMI event id */
+	__u32 data;		/* WMI event data */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC time of the notification */
+};
+
+struct hp_wmi_event_stats {
+	__u64 delivered;	/* records queued to this reader */
+	__u64 overflows;	/* records dropped because the ring was full */
+	__u32 queued;		/* records waiting to be read */
+	__u32 capacity;		/* size of the ring in records */
+};
+
+/* Bit n of the filter selects event id n; ids above 63 all map to bit 63. */
+#define HP_WMI_EVENT_FILTER_BIT(id)	(1ULL << ((id) < 63 ? (id) : 63))
+
+#define HP_WMI_IOC_MAGIC		'H'
+#define HP_WMI_IOC_EVT_GET_STATS	_IOR(HP_WMI_IOC_MAGIC, 0x01, struct hp_wmi_event_stats)
+#define HP_WMI_IOC_EVT_SET_FILTER	_IOW(HP_WMI_IOC_MAGIC, 0x02, __u64)
+#define HP_WMI_IOC_EVT_GET_FILTER	_IOR(HP_WMI_IOC_MAGIC, 0x03, __u64)
+
+/*
+ * /dev/hp-wmi-ctl: HP_WMI_IOC_CTL_TRANSACT runs an array of operations in
+ * order as one transaction, with other writers of these settings held off
+ * until it is done. Every operation is checked before any of them runs; the
+ * first one that fails cancels the rest (-ECANCELED). Back-to-back zone
+ * colours go to the firmware as one block write, and back-to-back writes of
+ * one setting only send the last value. The ioctl returns 0 or the first
+ * error, and each operation's own result is written back to its record.
+ */
+enum hp_wmi_ctl_type {
+	HP_WMI_CTL_PROFILE = 1,		/* value: HP_WMI_CTL_PROFILE_* */
+	HP_WMI_CTL_FAN_MAX = 2,		/* value: 1 full speed, 0 BIOS control */
+	HP_WMI_CTL_ZONE_COLOR = 3,	/* index: zone, value: 0xRRGGBB */
+	HP_WMI_CTL_BRIGHTNESS = 4,	/* value: keyboard backlight, 1 on, 0 off */
+};
+
+#define HP_WMI_CTL_PROFILE_COOL		0
+#define HP_WMI_CTL_PROFILE_BALANCED	1
+#define HP_WMI_CTL_PROFILE_PERFORMANCE	2
+
+/* Read the setting back into value instead of writing it */
+#define HP_WMI_CTL_OP_READ		(1U << 0)
+
+struct hp_wmi_ctl_op {
+	__u32 type;		/* enum hp_wmi_ctl_type */
+	__u32 flags;		/* HP_WMI_CTL_OP_* */
+	__u32 index;
+	__u32 value;
+	__s32 result;		/* out: 0 or a negative errno */
+	__u32 reserved;		/* must be 0 */
+};
+
+#define HP_WMI_CTL_MAX_OPS		64
+
+struct hp_wmi_ctl_transaction {
+	__u64 ops;		/* pointer to count struct hp_wmi_ctl_op */
+	__u32 count;		/* 1 to HP_WMI_CTL_MAX_OPS */
+	__u32 flags;		/* must be 0 */
+};
+
+#define HP_WMI_IOC_CTL_TRANSACT		_IOW(HP_WMI_IOC_MAGIC, 0x10, struct hp_wmi_ctl_transaction)
+
+#endif /* _HP_WMI_IOCTL_H */
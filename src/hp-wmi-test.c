@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * KUnit tests for the HP WMI driver
+ *
+ * Built into hp-wmi.ko with CONFIG_HP_WMI_KUNIT_TEST and run against the
+ * emulated BIOS, so the module has to be loaded with emulate=1. The file is
+ * included at the end of hp-wmi.c to reach the driver's statics.
+ */
+
+#include <kunit/test.h>
+
+static const u8 hp_wmi_test_rgb[FOURZONE_COUNT][3] = {
+	{ 0xff, 0x00, 0x00 }, { 0x00, 0xff, 0x00 }, { 0x00, 0x00, 0xff }, { 0x12, 0x34, 0x56 },
+};
+
+/* Everything a case may change, saved by hp_wmi_test_init() and put back on exit */
+struct hp_wmi_test_state {
+	u32 als, fan_max, latency_us, fail_every;
+	u16 fan_rpm[HPWMI_EMUL_FANS];
+	enum hp_wmi_fan_mode fan_mode;
+	bool fan_mode_user;
+	bool gov_enabled;
+	bool profile_valid;
+	enum platform_profile_option profile;
+	bool zones_valid;
+	struct color_platform zones[FOURZONE_COUNT];
+	struct hp_throttle_stat throttle[ARRAY_SIZE(hp_throttle)];
+};
+
+static const struct platform_profile_ops *hp_wmi_test_profile_ops(void)
+{
+	return is_omen_thermal_profile() ? &hp_wmi_omen_profile_ops : &hp_wmi_profile_ops;
+}
+
+static void hp_wmi_test_als(struct kunit *test)
+{
+	char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	KUNIT_ASSERT_EQ(test, als_store(NULL, NULL, "1", 1), 1);
+	scoped_guard(mutex, &hp_wmi_emul.lock)
+		KUNIT_EXPECT_EQ(test, hp_wmi_emul.als, 1);
+	KUNIT_EXPECT_GT(test, als_show(NULL, NULL, buf), 0);
+	KUNIT_EXPECT_STREQ(test, buf, "1\n");
+	KUNIT_EXPECT_EQ(test, als_store(NULL, NULL, "x", 1), -EINVAL);
+}
+
+static void hp_wmi_test_hddtemp(struct kunit *test)
+{
+	char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	KUNIT_EXPECT_GT(test, hddtemp_show(NULL, NULL, buf), 0);
+	KUNIT_EXPECT_STREQ(test, buf, "38\n");
+}
+
+static void hp_wmi_test_zones(struct kunit *test)
+{
+	static const char set[] = "ff0000 00ff00 0000ff 123456\n";
+	char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	u8 fw[FOURZONE_COUNT * 3];
+	int zi, i;
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	if (!zone_attribute_group.attrs)
+		kunit_skip(test, "no FourZone lighting");
+	if (READ_ONCE(fourzone_effect) != FOURZONE_EFFECT_NONE)
+		kunit_skip(test, "a lighting effect is running");
+
+	KUNIT_ASSERT_EQ(test, all_zones_rgb_store(NULL, NULL, set, strlen(set)), (ssize_t)strlen(set));
+	KUNIT_EXPECT_GT(test, all_zones_rgb_show(NULL, NULL, buf), 0);
+	KUNIT_EXPECT_STREQ(test, buf, set);
+
+	/* The BIOS gets the colours scaled by each zone's LED brightness */
+	scoped_guard(mutex, &hp_wmi_emul.lock)
+		memcpy(fw, &hp_wmi_emul.fourzone[FOURZONE_FIRST_OFFSET], sizeof(fw));
+	for (zi = 0; zi < FOURZONE_COUNT; zi++)
+		for (i = 0; i < 3; i++)
+			KUNIT_EXPECT_EQ(test, fw[zi * 3 + i], hp_wmi_test_rgb[zi][i] * fourzone_level[zi] / LED_FULL);
+
+	KUNIT_EXPECT_EQ(test, all_zones_rgb_store(NULL, NULL, "ff0000", 6), -EINVAL);
+}
+
+static void hp_wmi_test_fan_input(struct kunit *test)
+{
+	long val;
+	int rpm;
+
+	if (!hp_wmi_fan_count)
+		kunit_skip(test, "no fans");
+	/* Make the next read sweep the BIOS instead of using the sampler's value */
+	scoped_guard(mutex, &hp_wmi_fan_lock)
+		hp_wmi_fan_stamp = 0;
+	KUNIT_ASSERT_EQ(test, hp_wmi_hwmon_read(NULL, hwmon_fan, hwmon_fan_input, 0, &val), 0);
+	scoped_guard(mutex, &hp_wmi_emul.lock)
+		rpm = hp_wmi_emul.fan_max ? 5500 : hp_wmi_emul.fan_rpm[0];
+	KUNIT_EXPECT_EQ(test, val, rpm);
+}
+
+static void hp_wmi_test_pwm_enable(struct kunit *test)
+{
+	long val;
+
+	if (!hp_wmi_fan_count)
+		kunit_skip(test, "no fans");
+
+	KUNIT_ASSERT_EQ(test, hp_wmi_hwmon_write(NULL, hwmon_pwm, hwmon_pwm_enable, 0, HPWMI_FAN_MODE_FULL), 0);
+	scoped_guard(mutex, &hp_wmi_emul.lock)
+		KUNIT_EXPECT_EQ(test, hp_wmi_emul.fan_max, 1);
+	KUNIT_ASSERT_EQ(test, hp_wmi_hwmon_read(NULL, hwmon_pwm, hwmon_pwm_enable, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, HPWMI_FAN_MODE_FULL);
+
+	KUNIT_ASSERT_EQ(test, hp_wmi_hwmon_write(NULL, hwmon_pwm, hwmon_pwm_enable, 0, HPWMI_FAN_MODE_BIOS), 0);
+	scoped_guard(mutex, &hp_wmi_emul.lock)
+		KUNIT_EXPECT_EQ(test, hp_wmi_emul.fan_max, 0);
+	KUNIT_ASSERT_EQ(test, hp_wmi_hwmon_read(NULL, hwmon_pwm, hwmon_pwm_enable, 0, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, HPWMI_FAN_MODE_BIOS);
+
+	KUNIT_EXPECT_EQ(test, hp_wmi_hwmon_write(NULL, hwmon_pwm, hwmon_pwm_enable, 0, 4), -EINVAL);
+}
+
+/* Setting a profile turns the automatic governor off, as any manual write does */
+static void hp_wmi_test_platform_profile(struct kunit *test)
+{
+	static const enum platform_profile_option profiles[] = {
+		PLATFORM_PROFILE_PERFORMANCE, PLATFORM_PROFILE_COOL, PLATFORM_PROFILE_BALANCED,
+	};
+	static const int omen_raw[] = {
+		HP_OMEN_THERMAL_PROFILE_PERFORMANCE, HP_OMEN_THERMAL_PROFILE_COOL, HP_OMEN_THERMAL_PROFILE_DEFAULT,
+	};
+	static const int generic_raw[] = {
+		HP_THERMAL_PROFILE_PERFORMANCE, HP_THERMAL_PROFILE_COOL, HP_THERMAL_PROFILE_DEFAULT,
+	};
+	bool omen = is_omen_thermal_profile();
+	const struct platform_profile_ops *ops = hp_wmi_test_profile_ops();
+	enum platform_profile_option p;
+	int i, raw;
+
+	if (!platform_profile_support)
+		kunit_skip(test, "no platform_profile");
+
+	for (i = 0; i < ARRAY_SIZE(profiles); i++) {
+		KUNIT_ASSERT_EQ(test, ops->profile_set(NULL, profiles[i]), 0);
+		scoped_guard(mutex, &hp_wmi_emul.lock)
+			raw = omen ? hp_wmi_emul.ec_profile : hp_wmi_emul.thermal_profile;
+		KUNIT_EXPECT_EQ(test, raw, omen ? omen_raw[i] : generic_raw[i]);
+		hp_wmi_cache_invalidate_all();
+		KUNIT_ASSERT_EQ(test, ops->profile_get(NULL, &p), 0);
+		KUNIT_EXPECT_EQ(test, p, profiles[i]);
+	}
+	KUNIT_EXPECT_EQ(test, ops->profile_set(NULL, PLATFORM_PROFILE_LOW_POWER), -EINVAL);
+}
+
+static struct hp_throttle_stat *hp_wmi_test_throttle_stat(u32 id)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hp_throttle); i++)
+		if (hp_throttle[i].id == id)
+			return &hp_throttle[i];
+	return NULL;
+}
+
+static void hp_wmi_test_notify_one(u32 id, u32 data)
+{
+	u32 ev[2] = { id, data };
+	union acpi_object obj = { .buffer = { .type = ACPI_TYPE_BUFFER, .length = sizeof(ev), .pointer = (u8 *)ev } };
+
+	hp_wmi_notify(&obj, NULL);
+	flush_work(&hp_wmi_event_work);
+}
+
+/* An event goes from the notify callback through the ring to the accounting */
+static void hp_wmi_test_notify(struct kunit *test)
+{
+	struct hp_throttle_stat *st = hp_wmi_test_throttle_stat(HPWMI_SMART_ADAPTER);
+	u64 count;
+	bool active;
+
+	KUNIT_ASSERT_NOT_NULL(test, st);
+	scoped_guard(mutex, &hp_throttle_lock) {
+		count = st->count;
+		active = st->active;
+	}
+	if (active)
+		kunit_skip(test, "smart adapter throttling already active");
+
+	hp_wmi_test_notify_one(HPWMI_SMART_ADAPTER, 1);
+	scoped_guard(mutex, &hp_throttle_lock) {
+		KUNIT_EXPECT_EQ(test, st->count, count + 1);
+		KUNIT_EXPECT_TRUE(test, st->active);
+		KUNIT_EXPECT_EQ(test, st->last_data, 1);
+	}
+
+	hp_wmi_test_notify_one(HPWMI_SMART_ADAPTER, 0);
+	scoped_guard(mutex, &hp_throttle_lock) {
+		KUNIT_EXPECT_EQ(test, st->count, count + 2);
+		KUNIT_EXPECT_FALSE(test, st->active);
+	}
+	KUNIT_EXPECT_TRUE(test, kfifo_is_empty(&hp_wmi_event_ring));
+}
+
+static u64 hp_wmi_test_time_ns(bool cached, u32 n, u32 *errors)
+{
+	u64 start = ktime_get_ns();
+	u32 i, v;
+
+	for (i = 0; i < n; i++) {
+		if (cached ? hp_wmi_read_int(HPWMI_HARDWARE_QUERY) < 0 :
+		    hp_wmi_perform_query(HPWMI_HARDWARE_QUERY, HPWMI_READ, &v, sizeof(v), sizeof(v)))
+			(*errors)++;
+		cond_resched();
+	}
+	return ktime_get_ns() - start;
+}
+
+/*
+ * Not a correctness check: reports what a query costs through the full
+ * dispatcher and through the read cache, on the emulator with no latency.
+ * debugfs bench does the same against either backend.
+ */
+static void hp_wmi_test_bench_query(struct kunit *test)
+{
+	const u32 n = 10000;
+	u32 errors = 0;
+	u64 direct, cached;
+
+	scoped_guard(mutex, &hp_wmi_emul.lock) {
+		hp_wmi_emul.latency_us = 0;
+		hp_wmi_emul.fail_every = 0;
+	}
+	direct = hp_wmi_test_time_ns(false, n, &errors);
+	cached = hp_wmi_test_time_ns(true, n, &errors);
+	KUNIT_EXPECT_EQ(test, errors, 0);
+	kunit_info(test, "hardware query x%u: %llu ns direct, %llu ns through the cache\n",
+		   n, div_u64(direct, n), div_u64(cached, n));
+}
+
+static int hp_wmi_test_init(struct kunit *test)
+{
+	struct hp_wmi_test_state *st;
+
+	if (!emulate)
+		kunit_skip(test, "load hp-wmi with emulate=1");
+	KUNIT_ASSERT_PTR_EQ(test, hp_wmi_transport, &hp_wmi_emul_transport);
+	st = kunit_kzalloc(test, sizeof(*st), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, st);
+
+	scoped_guard(mutex, &hp_wmi_emul.lock) {
+		st->als = hp_wmi_emul.als;
+		st->fan_max = hp_wmi_emul.fan_max;
+		st->latency_us = hp_wmi_emul.latency_us;
+		st->fail_every = hp_wmi_emul.fail_every;
+		memcpy(st->fan_rpm, hp_wmi_emul.fan_rpm, sizeof(st->fan_rpm));
+	}
+	scoped_guard(mutex, &hp_wmi_fan_curve_lock) {
+		st->fan_mode = hp_wmi_fan_mode;
+		st->fan_mode_user = hp_wmi_fan_mode_user;
+	}
+	st->gov_enabled = READ_ONCE(hp_gov.enabled);
+	st->profile_valid = platform_profile_support &&
+			    !hp_wmi_test_profile_ops()->profile_get(NULL, &st->profile);
+	st->zones_valid = zone_attribute_group.attrs && !fourzone_get_colors(st->zones);
+	scoped_guard(mutex, &hp_throttle_lock)
+		memcpy(st->throttle, hp_throttle, sizeof(st->throttle));
+
+	test->priv = st;
+	hp_wmi_cache_invalidate_all();
+	return 0;
+}
+
+static void hp_wmi_test_exit(struct kunit *test)
+{
+	struct hp_wmi_test_state *st = test->priv;
+	const struct platform_profile_ops *ops = hp_wmi_test_profile_ops();
+	enum platform_profile_option p;
+
+	if (!st)
+		return;
+	/* A profile write turns the governor off, so it goes first */
+	if (st->profile_valid && (ops->profile_get(NULL, &p) || p != st->profile))
+		ops->profile_set(NULL, st->profile);
+	if (st->gov_enabled && !READ_ONCE(hp_gov.enabled))
+		hp_gov_enable(true);
+	if (hp_wmi_fan_count) {
+		hp_wmi_fan_mode_set(st->fan_mode);
+		scoped_guard(mutex, &hp_wmi_fan_curve_lock)
+			hp_wmi_fan_mode_user = st->fan_mode_user;
+	}
+	if (st->zones_valid)
+		fourzone_set_colors(GENMASK(FOURZONE_COUNT - 1, 0), st->zones);
+	scoped_guard(mutex, &hp_throttle_lock)
+		memcpy(hp_throttle, st->throttle, sizeof(st->throttle));
+	scoped_guard(mutex, &hp_wmi_emul.lock) {
+		hp_wmi_emul.als = st->als;
+		hp_wmi_emul.fan_max = st->fan_max;
+		hp_wmi_emul.latency_us = st->latency_us;
+		hp_wmi_emul.fail_every = st->fail_every;
+		memcpy(hp_wmi_emul.fan_rpm, st->fan_rpm, sizeof(hp_wmi_emul.fan_rpm));
+	}
+	hp_wmi_cache_invalidate_all();
+}
+
+/* Tests run once the module is live; probe and input setup may still be going */
+static int hp_wmi_test_suite_init(struct kunit_suite *suite)
+{
+	wait_for_device_probe();
+	async_synchronize_full_domain(&hp_wmi_async_domain);
+	async_synchronize_full_domain(&hp_wmi_input_async_domain);
+	return 0;
+}
+
+static struct kunit_case hp_wmi_test_cases[] = {
+	KUNIT_CASE(hp_wmi_test_als),
+	KUNIT_CASE(hp_wmi_test_hddtemp),
+	KUNIT_CASE(hp_wmi_test_zones),
+	KUNIT_CASE(hp_wmi_test_fan_input),
+	KUNIT_CASE(hp_wmi_test_pwm_enable),
+	KUNIT_CASE(hp_wmi_test_platform_profile),
+	KUNIT_CASE(hp_wmi_test_notify),
+	KUNIT_CASE(hp_wmi_test_bench_query),
+	{}
+};
+
+static struct kunit_suite hp_wmi_test_suite = {
+	.name = "hp-wmi",
+	.suite_init = hp_wmi_test_suite_init,
+	.init = hp_wmi_test_init,
+	.exit = hp_wmi_test_exit,
+	.test_cases = hp_wmi_test_cases,
+};
+kunit_test_suite(hp_wmi_test_suite);
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Tracepoints for the HP WMI driver
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hp_wmi
+
+#if !defined(_HP_WMI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HP_WMI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(hp_wmi_query_start,
+	TP_PROTO(u32 command, u32 query, int insize, int outsize),
+	TP_ARGS(command, query, insize, outsize),
+	TP_STRUCT__entry(
+		__field(u32, command)
+		__field(u32, query)
+		__field(int, insize)
+		__field(int, outsize)
+	),
+	TP_fast_assign(
+		__entry->command = command;
+		__entry->query = query;
+		__entry->insize = insize;
+		__entry->outsize = outsize;
+	),
+	TP_printk("command=0x%x query=0x%x insize=%d outsize=%d",
+		  __entry->command, __entry->query, __entry->insize, __entry->outsize)
+);
+
+TRACE_EVENT(hp_wmi_query_end,
+	TP_PROTO(u32 command, u32 query, int insize, int outsize, int ret, u64 duration_ns),
+	TP_ARGS(command, query, insize, outsize, ret, duration_ns),
+	TP_STRUCT__entry(
+		__field(u32, command)
+		__field(u32, query)
+		__field(int, insize)
+		__field(int, outsize)
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+	TP_fast_assign(
+		__entry->command = command;
+		__entry->query = query;
+		__entry->insize = insize;
+		__entry->outsize = outsize;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("command=0x%x query=0x%x insize=%d outsize=%d ret=%d duration_ns=%llu",
+		  __entry->command, __entry->query, __entry->insize, __entry->outsize,
+		  __entry->ret, __entry->duration_ns)
+);
+
+TRACE_EVENT(hp_wmi_ec_read,
+	TP_PROTO(u8 addr, u8 val, int ret, u64 duration_ns),
+	TP_ARGS(addr, val, ret, duration_ns),
+	TP_STRUCT__entry(
+		__field(u8, addr)
+		__field(u8, val)
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+	TP_fast_assign(
+		__entry->addr = addr;
+		__entry->val = val;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("addr=0x%02x val=0x%02x ret=%d duration_ns=%llu",
+		  __entry->addr, __entry->val, __entry->ret, __entry->duration_ns)
+);
+
+TRACE_EVENT(hp_wmi_event,
+	TP_PROTO(u32 id, u32 data, u64 delay_ns),
+	TP_ARGS(id, data, delay_ns),
+	TP_STRUCT__entry(
+		__field(u32, id)
+		__field(u32, data)
+		__field(u64, delay_ns)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->data = data;
+		__entry->delay_ns = delay_ns;
+	),
+	TP_printk("id=0x%x data=0x%x delay_ns=%llu",
+		  __entry->id, __entry->data, __entry->delay_ns)
+);
+
+TRACE_EVENT(hp_wmi_throttle,
+	TP_PROTO(u32 id, u32 data, bool active, u64 count, u64 active_ns),
+	TP_ARGS(id, data, active, count, active_ns),
+	TP_STRUCT__entry(
+		__field(u32, id)
+		__field(u32, data)
+		__field(bool, active)
+		__field(u64, count)
+		__field(u64, active_ns)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->data = data;
+		__entry->active = active;
+		__entry->count = count;
+		__entry->active_ns = active_ns;
+	),
+	TP_printk("id=0x%x data=0x%x active=%d count=%llu active_ns=%llu",
+		  __entry->id, __entry->data, __entry->active, __entry->count, __entry->active_ns)
+);
+
+#endif /* _HP_WMI_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hp-wmi-trace
+#include <trace/define_trace.h>
@@ -23,6 +23,10 @@
 #include <linux/platform_device.h>
 #include <linux/platform_profile.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/thermal.h>
+#include <linux/tick.h>
+#include <linux/async.h>
 #include <linux/acpi.h>
 #include <linux/rfkill.h>
 #include <linux/string.h>
@@ -30,6 +34,39 @@
 #include <linux/mutex.h>
 #include <linux/cleanup.h>
 #include <linux/power_supply.h>
+#include <linux/led-class-multicolor.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+#include <linux/sched/signal.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/bsearch.h>
+#include <linux/rwsem.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/kfifo_buf.h>
+#include <linux/units.h>
+
+#define CREATE_TRACE_POINTS
+#include "hp-wmi-trace.h"
+#include "hp-wmi-ioctl.h"
+
+/*
+ * Per-board capabilities, generated from boards.json by gen_ident.py. A board
+ * that is not listed is probed for everything; a listed board has FOURZONE and
+ * GM cleared only where boards.json rules them out, and fans == 0 means probe.
+ */
+enum {
+	HPWMI_BOARD_FOURZONE = BIT(0),
+	HPWMI_BOARD_GM = BIT(1),
+	HPWMI_BOARD_OMEN_THERMAL = BIT(2),
+};
+struct hp_wmi_board { const char *name; u32 flags; u8 fans; };
+#include "hp-wmi-boards.h"
 
 MODULE_AUTHOR("Matthew Garrett <mjg59@srcf.ucam.org>");
 MODULE_DESCRIPTION("HP laptop WMI hotkeys driver");
@@ -46,15 +83,6 @@ MODULE_PARM_DESC(enable_tablet_mode_sw, "Enable SW_TABLET_MODE reporting (-1=aut
 #define HPWMI_BIOS_GUID "5FB7F034-2C63-45e9-BE91-3D44E2C707E4"
 #define HP_OMEN_EC_THERMAL_PROFILE_OFFSET 0x95
 
-static const char * const omen_thermal_profile_boards[] = {
-	"84DA", "84DB", "84DC", "8574", "8575", "860A", "87B5", "8572", "8573",
-	"8600", "8601", "8602", "8605", "8606", "8607", "8746", "8747", "8749",
-	"874A", "8603", "8604", "8748", "886B", "886C", "878A", "878B", "878C",
-	"88C8", "88CB", "8786", "8787", "8788", "88D1", "88D2", "88F4", "88FD",
-	"88F5", "88F6", "88F7", "88FE", "88FF", "8900", "8901", "8902", "8912",
-	"8917", "8918", "8949", "894A", "89EB"
-};
-
 enum hp_wmi_radio { HPWMI_WIFI = 0x0, HPWMI_BLUETOOTH = 0x1, HPWMI_WWAN = 0x2, HPWMI_GPS = 0x3 };
 enum hp_wmi_event_ids {
 	HPWMI_DOCK_EVENT = 0x01, HPWMI_PARK_HDD = 0x02, HPWMI_SMART_ADAPTER = 0x03,
@@ -72,13 +100,15 @@ enum hp_wmi_commandtype {
 	HPWMI_HARDWARE_QUERY = 0x04, HPWMI_WIRELESS_QUERY = 0x05, HPWMI_BATTERY_QUERY = 0x07,
 	HPWMI_BIOS_QUERY = 0x09, HPWMI_FEATURE_QUERY = 0x0b, HPWMI_HOTKEY_QUERY = 0x0c,
 	HPWMI_FEATURE2_QUERY = 0x0d, HPWMI_WIRELESS2_QUERY = 0x1b, HPWMI_POSTCODEERROR_QUERY = 0x2a,
-	HPWMI_THERMAL_PROFILE_QUERY = 0x4c, HPWMI_SYSTEM_DEVICE_MODE = 0x40,
+	HPWMI_THERMAL_PROFILE_QUERY = 0x4c, HPWMI_SYSTEM_DEVICE_MODE = 0x40, HPWMI_GPU_MODE_QUERY = 0x52,
 	HPWMI_FOURZONE_COLOR_GET = 2, HPWMI_FOURZONE_COLOR_SET = 3, HPWMI_FOURZONE_BRIGHT_GET = 4,
 	HPWMI_FOURZONE_BRIGHT_SET = 5, HPWMI_FOURZONE_ANIM_GET = 6, HPWMI_FOURZONE_ANIM_SET = 7,
 };
 enum hp_wmi_gm_commandtype {
-	HPWMI_FAN_SPEED_GET_QUERY = 0x11, HPWMI_SET_PERFORMANCE_MODE = 0x1A,
+	HPWMI_FAN_COUNT_GET_QUERY = 0x10, HPWMI_FAN_SPEED_GET_QUERY = 0x11, HPWMI_SET_PERFORMANCE_MODE = 0x1A,
+	HPWMI_GPU_MODES_GET_QUERY = 0x21, HPWMI_GPU_MODES_SET_QUERY = 0x22,
 	HPWMI_FAN_SPEED_MAX_GET_QUERY = 0x26, HPWMI_FAN_SPEED_MAX_SET_QUERY = 0x27,
+	HPWMI_FAN_LEVEL_GET_QUERY = 0x2D, HPWMI_FAN_LEVEL_SET_QUERY = 0x2E,
 };
 enum hp_wmi_command { HPWMI_READ = 0x01, HPWMI_WRITE = 0x02, HPWMI_ODM = 0x03, HPWMI_GM = 0x20008, HPWMI_FOURZONE = 0x20009 };
 enum hp_wmi_hardware_mask { HPWMI_DOCK_MASK = 0x01, HPWMI_TABLET_MASK = 0x04 };
@@ -93,6 +123,8 @@ enum hp_wireless2_bits {
 };
 enum hp_thermal_profile_omen { HP_OMEN_THERMAL_PROFILE_DEFAULT=0x00, HP_OMEN_THERMAL_PROFILE_PERFORMANCE=0x01, HP_OMEN_THERMAL_PROFILE_COOL=0x02 };
 enum hp_thermal_profile { HP_THERMAL_PROFILE_PERFORMANCE=0x00, HP_THERMAL_PROFILE_DEFAULT=0x01, HP_THERMAL_PROFILE_COOL=0x02 };
+struct hp_wmi_gpu_modes { u8 ctgp_enable; u8 ppab_enable; u8 dstate; u8 slowdown_temp; } __packed;
+enum hp_gpu_mode { HP_GPU_MODE_HYBRID = 0x00, HP_GPU_MODE_DISCRETE = 0x01 };
 #define IS_HWBLOCKED(x) ((x & HPWMI_POWER_FW_OR_HW) != HPWMI_POWER_FW_OR_HW)
 #define IS_SWBLOCKED(x) !(x & HPWMI_POWER_SOFT)
 struct bios_rfkill2_device_state { u8 radio_type; u8 bus_type; u16 vendor_id; u16 product_id; u16 subsys_vendor_id; u16 subsys_product_id; u8 rfkill_id; u8 power; u8 unknown[4]; };
@@ -127,9 +159,23 @@ static int rfkill2_count;
 static struct rfkill2_device rfkill2[HPWMI_MAX_RFKILL2_DEVICES];
 static const char * const tablet_chassis_types[] = { "30", "31", "32" };
 #define DEVICE_MODE_TABLET	0x06
-struct quirk_entry { bool fourzone; };
-static struct quirk_entry temp_omen = { .fourzone = true, };
-static struct quirk_entry *quirks = &temp_omen;
+static const struct hp_wmi_board *hp_wmi_board;
+/* Unknown boards may have anything, only a table entry rules a feature out */
+static bool hp_wmi_board_may(u32 flag) { return !hp_wmi_board || (hp_wmi_board->flags & flag); }
+
+/* Filled by the discovery pass at probe, see hp_wmi_discover() */
+enum hp_wmi_cap {
+	HPWMI_CAP_WIRELESS, HPWMI_CAP_FOURZONE, HPWMI_CAP_FOURZONE_ANIM, HPWMI_CAP_THERMAL,
+	HPWMI_CAP_GPU, HPWMI_CAP_GPU_MODE, HPWMI_CAP_ALS, HPWMI_CAP_HDDTEMP,
+	HPWMI_CAP_MAX
+};
+static DECLARE_BITMAP(hp_wmi_caps, HPWMI_CAP_MAX);
+static int hp_wmi_profile_boot;
+static ASYNC_DOMAIN_EXCLUSIVE(hp_wmi_async_domain);
+/* Kept apart so that probe does not wait for the hotkey input setup */
+static ASYNC_DOMAIN_EXCLUSIVE(hp_wmi_input_async_domain);
+/* Held for writing by /dev/hp-wmi-ctl transactions, see hp_wmi_ctl_ioctl() */
+static DECLARE_RWSEM(hp_wmi_ctl_rwsem);
 
 static inline int encode_outsize_for_pvsz(int outsize)
 {
@@ -141,367 +187,3845 @@ static inline int encode_outsize_for_pvsz(int outsize)
 	return 1;
 }
 
-static int hp_wmi_perform_query(int query, enum hp_wmi_command command, void *buffer, int insize, int outsize) {
+/*
+ * BIOS command dispatcher. Every call is queued and the queue is drained in
+ * order by whichever caller holds hp_wmi_exec_lock, so the firmware only ever
+ * sees one call at a time and writes to a target land in submission order.
+ * A read identical to one already queued or running shares its result, and a
+ * write that finds a still-pending write to the same target replaces that
+ * write's payload instead of queueing behind it.
+ */
+struct hp_wmi_req {
+	struct list_head node;
+	int query;
+	enum hp_wmi_command command;
+	int insize, outsize;
+	bool write, started, done;
+	unsigned int sharers;
+	int ret;
+	u8 in[128];
+	u8 out[128];
+};
+static LIST_HEAD(hp_wmi_queue);
+static DEFINE_SPINLOCK(hp_wmi_queue_lock);
+static DEFINE_MUTEX(hp_wmi_exec_lock);
+static DECLARE_WAIT_QUEUE_HEAD(hp_wmi_req_wq);
+
+/*
+ * Firmware transport. Everything that reaches the BIOS or the EC goes
+ * through these ops, so the driver can run against the emulated backend
+ * below on machines without the HP interface.
+ */
+struct hp_wmi_transport {
+	const char *name;
+	acpi_status (*evaluate)(u32 method_id, const struct acpi_buffer *in, struct acpi_buffer *out);
+	int (*ec_read)(u8 addr, u8 *val);
+};
+
+static acpi_status hp_wmi_acpi_evaluate(u32 method_id, const struct acpi_buffer *in, struct acpi_buffer *out)
+{
+	return wmi_evaluate_method(HPWMI_BIOS_GUID, 0, method_id, in, out);
+}
+
+static const struct hp_wmi_transport hp_wmi_acpi_transport = {
+	.name = "acpi",
+	.evaluate = hp_wmi_acpi_evaluate,
+	.ec_read = ec_read,
+};
+static const struct hp_wmi_transport *hp_wmi_transport = &hp_wmi_acpi_transport;
+
+/*
+ * Output buffer for the WMI call, sized for the largest reply class so ACPICA
+ * never has to allocate. Only used under hp_wmi_exec_lock.
+ */
+#define HPWMI_OUT_BUF_SIZE (sizeof(union acpi_object) + sizeof(struct bios_return) + 4096)
+static u8 hp_wmi_out_buf[HPWMI_OUT_BUF_SIZE] __aligned(sizeof(u64));
+
+static int hp_wmi_evaluate(struct hp_wmi_req *rq) {
 	int mid, actual_outsize, ret = 0;
 	struct bios_return *bios_return;
 	union acpi_object *obj;
-	struct bios_args args = { .signature = 0x55434553, .command = command, .commandtype = query, .datasize = insize, .data = {0} };
+	acpi_status status;
+	struct bios_args args = { .signature = 0x55434553, .command = rq->command, .commandtype = rq->query, .datasize = rq->insize, .data = {0} };
 	struct acpi_buffer input = { sizeof(struct bios_args), &args };
-	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+	struct acpi_buffer output = { sizeof(hp_wmi_out_buf), hp_wmi_out_buf };
 
-	mid = encode_outsize_for_pvsz(outsize);
+	lockdep_assert_held(&hp_wmi_exec_lock);
+	mid = encode_outsize_for_pvsz(rq->outsize);
 	if (WARN_ON(mid < 0)) return mid;
-	if (WARN_ON(insize > sizeof(args.data))) return -EINVAL;
-	if (insize > 0 && buffer) memcpy(&args.data[0], buffer, insize);
+	if (rq->insize > 0) memcpy(&args.data[0], rq->in, rq->insize);
 
-	wmi_evaluate_method(HPWMI_BIOS_GUID, 0, mid, &input, &output);
-	obj = output.pointer;
+	status = hp_wmi_transport->evaluate(mid, &input, &output);
+	if (status == AE_BUFFER_OVERFLOW) { pr_warn("query 0x%x reply too large (%zu)\n", rq->query, (size_t)output.length); return -EOVERFLOW; }
+	obj = ACPI_SUCCESS(status) ? output.pointer : NULL;
 	if (!obj) return -EINVAL;
-	if (obj->type != ACPI_TYPE_BUFFER) { ret = -EINVAL; goto out_free; }
+	if (obj->type != ACPI_TYPE_BUFFER || obj->buffer.length < sizeof(*bios_return)) return -EINVAL;
 
 	bios_return = (struct bios_return *)obj->buffer.pointer;
 	ret = bios_return->return_code;
 	if (ret) {
 		if (ret != HPWMI_RET_UNKNOWN_COMMAND && ret != HPWMI_RET_UNKNOWN_CMDTYPE)
-			pr_warn("query 0x%x cmd 0x%x err 0x%x\n", query, command, ret);
-		goto out_free;
+			pr_warn("query 0x%x cmd 0x%x err 0x%x\n", rq->query, rq->command, ret);
+		return ret;
 	}
-	if (!outsize) goto out_free;
-	actual_outsize = min_t(int, outsize, obj->buffer.length - sizeof(*bios_return));
-	if (buffer) {
-		memcpy(buffer, obj->buffer.pointer + sizeof(*bios_return), actual_outsize);
-		if (outsize > actual_outsize) memset(buffer + actual_outsize, 0, outsize - actual_outsize);
-	}
-out_free:
-	kfree(obj);
-	return ret;
+	if (!rq->outsize) return 0;
+	actual_outsize = min_t(int, rq->outsize, obj->buffer.length - sizeof(*bios_return));
+	memcpy(rq->out, obj->buffer.pointer + sizeof(*bios_return), actual_outsize);
+	if (rq->outsize > actual_outsize) memset(rq->out + actual_outsize, 0, rq->outsize - actual_outsize);
+	return 0;
 }
 
-static int hp_wmi_get_fan_speed(int fan) {
-	u8 fsh, fsl; char fan_data[4] = { fan, 0, 0, 0 };
-	if (hp_wmi_perform_query(HPWMI_FAN_SPEED_GET_QUERY, HPWMI_GM, &fan_data, sizeof(fan_data), sizeof(fan_data)) != 0) return -EINVAL;
-	fsh = fan_data[2]; fsl = fan_data[3]; return (fsh << 8) | fsl;
+/* Writes whose payload is the complete new state of their target */
+static bool hp_wmi_write_supersedes(int query, enum hp_wmi_command command)
+{
+	switch (command) {
+	case HPWMI_FOURZONE:
+		return query == HPWMI_FOURZONE_COLOR_SET || query == HPWMI_FOURZONE_BRIGHT_SET ||
+		       query == HPWMI_FOURZONE_ANIM_SET;
+	case HPWMI_GM:
+		return query == HPWMI_SET_PERFORMANCE_MODE || query == HPWMI_FAN_SPEED_MAX_SET_QUERY ||
+		       query == HPWMI_FAN_LEVEL_SET_QUERY;
+	case HPWMI_WRITE:
+		return query == HPWMI_THERMAL_PROFILE_QUERY || query == HPWMI_ALS_QUERY;
+	default:
+		return false;
+	}
 }
-static int hp_wmi_read_int(int query) {
-	int val = 0, ret = hp_wmi_perform_query(query, HPWMI_READ, &val, sizeof(val), sizeof(val));
-	return ret ? (ret < 0 ? ret : -EINVAL) : val;
+
+static struct hp_wmi_req *hp_wmi_find_shared(const struct hp_wmi_req *rq)
+{
+	struct hp_wmi_req *cur;
+
+	lockdep_assert_held(&hp_wmi_queue_lock);
+	list_for_each_entry_reverse(cur, &hp_wmi_queue, node) {
+		if (cur->command != rq->command)
+			continue;
+		if (rq->write) {
+			if (!cur->write)
+				continue;
+			/* Only the last queued write may take this one, or it would jump the writes after it */
+			if (!cur->started && cur->query == rq->query && cur->insize == rq->insize &&
+			    hp_wmi_write_supersedes(rq->query, rq->command))
+				return cur;
+			return NULL;
+		}
+		/* Don't let a read skip past a write to the same command space */
+		if (cur->write)
+			return NULL;
+		if (cur->query == rq->query && cur->insize == rq->insize && cur->outsize == rq->outsize &&
+		    !memcmp(cur->in, rq->in, rq->insize))
+			return cur;
+	}
+	return NULL;
 }
-static int hp_wmi_hw_state(int mask) { int s = hp_wmi_read_int(HPWMI_HARDWARE_QUERY); return (s < 0) ? s : !!(s & mask); }
-static int omen_thermal_profile_set(int mode) {
-	char b[2] = {0, mode}; int r; if (mode < 0 || mode > 2) return -EINVAL;
-	r = hp_wmi_perform_query(HPWMI_SET_PERFORMANCE_MODE, HPWMI_GM, &b, sizeof(b), 0); return r ? (r < 0 ? r : -EINVAL) : 0;
+
+/*
+ * Per (command, commandtype) call accounting, exported through debugfs.
+ * Latency buckets are log2 of the call time in microseconds: bucket 0 is
+ * under 1us and bucket n covers [2^(n-1), 2^n) us.
+ */
+#define HPWMI_STATS_SLOTS 64
+#define HPWMI_LAT_BUCKETS 24
+struct hp_wmi_query_stats {
+	u32 command, query;
+	bool used;
+	u64 calls, errors, unsupported, coalesced, total_ns, max_ns;
+	u32 hist[HPWMI_LAT_BUCKETS];
+};
+static struct hp_wmi_query_stats hp_wmi_stats[HPWMI_STATS_SLOTS];
+static struct hp_wmi_query_stats hp_wmi_ec_stats = { .query = HP_OMEN_EC_THERMAL_PROFILE_OFFSET, .used = true };
+static DEFINE_SPINLOCK(hp_wmi_stats_lock);
+static struct dentry *hp_wmi_debugfs;
+
+static struct hp_wmi_query_stats *hp_wmi_stats_slot(u32 command, u32 query)
+{
+	unsigned int i, h = (command * 31 + query) % HPWMI_STATS_SLOTS;
+
+	lockdep_assert_held(&hp_wmi_stats_lock);
+	for (i = 0; i < HPWMI_STATS_SLOTS; i++) {
+		struct hp_wmi_query_stats *st = &hp_wmi_stats[(h + i) % HPWMI_STATS_SLOTS];
+
+		if (!st->used) {
+			st->used = true;
+			st->command = command;
+			st->query = query;
+			return st;
+		}
+		if (st->command == command && st->query == query)
+			return st;
+	}
+	return NULL;
 }
-static bool is_omen_thermal_profile(void) {
-	const char *bn = dmi_get_system_info(DMI_BOARD_NAME); if (!bn) return false;
-	return match_string(omen_thermal_profile_boards, ARRAY_SIZE(omen_thermal_profile_boards), bn) >= 0;
+
+static void hp_wmi_stats_account(struct hp_wmi_query_stats *st, int ret, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	if (!st)
+		return;
+	st->calls++;
+	if (ret == HPWMI_RET_UNKNOWN_COMMAND || ret == HPWMI_RET_UNKNOWN_CMDTYPE)
+		st->unsupported++;
+	else if (ret)
+		st->errors++;
+	st->total_ns += ns;
+	st->max_ns = max(st->max_ns, ns);
+	st->hist[us ? min_t(int, fls64(us), HPWMI_LAT_BUCKETS - 1) : 0]++;
 }
-static int omen_thermal_profile_get(void) { u8 d; int r = ec_read(HP_OMEN_EC_THERMAL_PROFILE_OFFSET, &d); return r < 0 ? r : d; }
-static int hp_wmi_fan_speed_max_set(int en) { int v = en, r = hp_wmi_perform_query(HPWMI_FAN_SPEED_MAX_SET_QUERY, HPWMI_GM, &v, sizeof(v), 0); return r ? (r < 0 ? r : -EINVAL) : 0; }
-static int hp_wmi_fan_speed_max_get(void) {
-	int v = 0, r = hp_wmi_perform_query(HPWMI_FAN_SPEED_MAX_GET_QUERY, HPWMI_GM, &v, sizeof(v), sizeof(v)); return r ? (r < 0 ? r : -EINVAL) : v;
+
+static void hp_wmi_stats_query(u32 command, u32 query, int ret, u64 ns)
+{
+	guard(spinlock)(&hp_wmi_stats_lock);
+	hp_wmi_stats_account(hp_wmi_stats_slot(command, query), ret, ns);
 }
-static int __init hp_wmi_bios_2008_later(void) {
-	int s = 0, r = hp_wmi_perform_query(HPWMI_FEATURE_QUERY, HPWMI_READ, &s, sizeof(s), sizeof(s));
-	return !r ? 1 : ((r == HPWMI_RET_UNKNOWN_CMDTYPE) ? 0 : -ENXIO);
+
+static void hp_wmi_stats_coalesced(u32 command, u32 query)
+{
+	struct hp_wmi_query_stats *st;
+
+	guard(spinlock)(&hp_wmi_stats_lock);
+	st = hp_wmi_stats_slot(command, query);
+	if (st)
+		st->coalesced++;
 }
-static int __init hp_wmi_bios_2009_later(void) {
-	u8 s[128] = {0}; int r = hp_wmi_perform_query(HPWMI_FEATURE2_QUERY, HPWMI_READ, &s, sizeof(s), sizeof(s));
-	return !r ? 1 : ((r == HPWMI_RET_UNKNOWN_CMDTYPE) ? 0 : -ENXIO);
+
+static void hp_wmi_stats_print(struct seq_file *m, const char *cmd, const struct hp_wmi_query_stats *st)
+{
+	seq_printf(m, "%-8s 0x%02x %10llu %8llu %11llu %9llu %8llu %8llu\n", cmd, st->query,
+		   st->calls, st->errors, st->unsupported, st->coalesced,
+		   st->calls ? div64_u64(st->total_ns, st->calls * NSEC_PER_USEC) : 0,
+		   div_u64(st->max_ns, NSEC_PER_USEC));
 }
-static int __init hp_wmi_enable_hotkeys(void) { int v = 0x6e, r = hp_wmi_perform_query(HPWMI_BIOS_QUERY, HPWMI_WRITE, &v, sizeof(v), 0); return r <= 0 ? r : -EINVAL; }
-static int hp_wmi_set_block(void *data, bool blocked) {
-	enum hp_wmi_radio r = (enum hp_wmi_radio)(uintptr_t)data; int q = BIT(r + 8) | ((!blocked) << r);
-	int ret = hp_wmi_perform_query(HPWMI_WIRELESS_QUERY, HPWMI_WRITE, &q, sizeof(q), 0); return ret <= 0 ? ret : -EINVAL;
+
+static int query_stats_show(struct seq_file *m, void *unused)
+{
+	char cmd[12];
+	int i;
+
+	seq_puts(m, "command  query      calls   errors unsupported coalesced   avg_us   max_us\n");
+	guard(spinlock)(&hp_wmi_stats_lock);
+	for (i = 0; i < HPWMI_STATS_SLOTS; i++) {
+		if (!hp_wmi_stats[i].used)
+			continue;
+		snprintf(cmd, sizeof(cmd), "0x%x", hp_wmi_stats[i].command);
+		hp_wmi_stats_print(m, cmd, &hp_wmi_stats[i]);
+	}
+	hp_wmi_stats_print(m, "ec_read", &hp_wmi_ec_stats);
+	return 0;
 }
-static const struct rfkill_ops hp_wmi_rfkill_ops = { .set_block = hp_wmi_set_block };
-static bool hp_wmi_get_sw_state(enum hp_wmi_radio r) {
-	int m = 0x200 << (r * 8), w = hp_wmi_read_int(HPWMI_WIRELESS_QUERY); if (w < 0) { WARN_ONCE(1, "err HPWMI_WIRELESS_QUERY SW"); return true; } return !(w & m);
+DEFINE_SHOW_ATTRIBUTE(query_stats);
+
+static void hp_wmi_hist_print(struct seq_file *m, const char *cmd, const struct hp_wmi_query_stats *st)
+{
+	int b;
+
+	seq_printf(m, "%-8s 0x%02x", cmd, st->query);
+	for (b = 0; b < HPWMI_LAT_BUCKETS; b++)
+		seq_printf(m, " %u", st->hist[b]);
+	seq_putc(m, '\n');
 }
-static int camera_shutter_input_setup(void) {
-	int err; camera_shutter_input_dev = input_allocate_device(); if (!camera_shutter_input_dev) return -ENOMEM;
-	camera_shutter_input_dev->name = "HP WMI camera shutter"; camera_shutter_input_dev->phys = "wmi/input1"; camera_shutter_input_dev->id.bustype = BUS_HOST;
-	__set_bit(EV_SW, camera_shutter_input_dev->evbit); __set_bit(SW_CAMERA_LENS_COVER, camera_shutter_input_dev->swbit);
-	err = input_register_device(camera_shutter_input_dev); if (err) goto err_free_dev; return 0;
-err_free_dev: input_free_device(camera_shutter_input_dev); camera_shutter_input_dev = NULL; return err;
+
+static int query_latency_show(struct seq_file *m, void *unused)
+{
+	char cmd[12];
+	int i;
+
+	seq_puts(m, "# command query, then call counts per log2(us) bucket: <1 <2 <4 <8 ... us\n");
+	guard(spinlock)(&hp_wmi_stats_lock);
+	for (i = 0; i < HPWMI_STATS_SLOTS; i++) {
+		if (!hp_wmi_stats[i].used)
+			continue;
+		snprintf(cmd, sizeof(cmd), "0x%x", hp_wmi_stats[i].command);
+		hp_wmi_hist_print(m, cmd, &hp_wmi_stats[i]);
+	}
+	hp_wmi_hist_print(m, "ec_read", &hp_wmi_ec_stats);
+	return 0;
 }
-static bool hp_wmi_get_hw_state(enum hp_wmi_radio r) {
-	int m = 0x800 << (r * 8), w = hp_wmi_read_int(HPWMI_WIRELESS_QUERY); if (w < 0) { WARN_ONCE(1, "err HPWMI_WIRELESS_QUERY HW"); return true; } return !(w & m);
+DEFINE_SHOW_ATTRIBUTE(query_latency);
+
+static ssize_t stats_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	guard(spinlock)(&hp_wmi_stats_lock);
+	memset(hp_wmi_stats, 0, sizeof(hp_wmi_stats));
+	memset(&hp_wmi_ec_stats, 0, sizeof(hp_wmi_ec_stats));
+	hp_wmi_ec_stats.query = HP_OMEN_EC_THERMAL_PROFILE_OFFSET;
+	hp_wmi_ec_stats.used = true;
+	return count;
 }
-static int hp_wmi_rfkill2_set_block(void *data, bool blocked) {
-	int id = (int)(uintptr_t)data; char b[4] = {0x01, 0x00, id, !blocked};
-	int ret = hp_wmi_perform_query(HPWMI_WIRELESS2_QUERY, HPWMI_WRITE, b, sizeof(b), 0); return ret <= 0 ? ret : -EINVAL;
+
+static const struct file_operations stats_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = stats_reset_write,
+};
+
+/*
+ * Commands the BIOS answered with "unknown command/commandtype". They cannot
+ * start working later, so the dispatcher fails them without evaluating AML.
+ * An unknown command marks every query of that command.
+ */
+#define HPWMI_NEG_COMMANDS 5
+static DECLARE_BITMAP(hp_wmi_unsupported, HPWMI_NEG_COMMANDS * 256);
+static DECLARE_BITMAP(hp_wmi_unsupported_cmd, HPWMI_NEG_COMMANDS);
+static const enum hp_wmi_command hp_wmi_neg_commands[HPWMI_NEG_COMMANDS] = { HPWMI_READ, HPWMI_WRITE, HPWMI_ODM, HPWMI_GM, HPWMI_FOURZONE };
+
+static int hp_wmi_neg_slot(enum hp_wmi_command command)
+{
+	int i;
+
+	for (i = 0; i < HPWMI_NEG_COMMANDS; i++)
+		if (hp_wmi_neg_commands[i] == command)
+			return i;
+	return -1;
 }
-static const struct rfkill_ops hp_wmi_rfkill2_ops = { .set_block = hp_wmi_rfkill2_set_block };
-static int hp_wmi_rfkill2_refresh(void) {
-	struct bios_rfkill2_state s = {0}; int err, i; err = hp_wmi_perform_query(HPWMI_WIRELESS2_QUERY, HPWMI_READ, &s, sizeof(s), sizeof(s));
-	if (err) return err < 0 ? err : -EINVAL;
-	for (i = 0; i < rfkill2_count; i++) { int num = rfkill2[i].num; struct bios_rfkill2_device_state *ds;
-		if (num >= s.count) { pr_warn("rfkill idx %d OOB (%d)\n", num, s.count); continue; } ds = &s.device[num];
-		if (ds->rfkill_id != rfkill2[i].id) { pr_warn("rfkill config changed\n"); continue; }
-		if (rfkill2[i].rfkill) rfkill_set_states(rfkill2[i].rfkill, IS_SWBLOCKED(ds->power), IS_HWBLOCKED(ds->power));
-	} return 0;
+
+static int hp_wmi_neg_lookup(int query, enum hp_wmi_command command)
+{
+	int slot = hp_wmi_neg_slot(command);
+
+	if (slot < 0 || query < 0 || query > 0xff)
+		return 0;
+	if (test_bit(slot, hp_wmi_unsupported_cmd))
+		return HPWMI_RET_UNKNOWN_COMMAND;
+	return test_bit(slot * 256 + query, hp_wmi_unsupported) ? HPWMI_RET_UNKNOWN_CMDTYPE : 0;
 }
-static ssize_t display_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_read_int(HPWMI_DISPLAY_QUERY); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
-static ssize_t hddtemp_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_read_int(HPWMI_HDDTEMP_QUERY); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
-static ssize_t als_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_read_int(HPWMI_ALS_QUERY); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
-static ssize_t dock_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_hw_state(HPWMI_DOCK_MASK); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
-static ssize_t tablet_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_hw_state(HPWMI_TABLET_MASK); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
-static ssize_t postcode_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_read_int(HPWMI_POSTCODEERROR_QUERY); return v < 0 ? v : sysfs_emit(b, "0x%x\n", v); }
-static ssize_t als_store(struct device *d, struct device_attribute *a, const char *b, size_t c) { u32 t; int r = kstrtou32(b, 10, &t); if (r) return r; r = hp_wmi_perform_query(HPWMI_ALS_QUERY, HPWMI_WRITE, &t, sizeof(t), 0); return r ? (r < 0 ? r : -EINVAL) : c; }
-static ssize_t postcode_store(struct device *d, struct device_attribute *a, const char *b, size_t c) { u32 t = 1; bool cl; int r = kstrtobool(b, &cl); if (r) return r; if (!cl) return -EINVAL; r = hp_wmi_perform_query(HPWMI_POSTCODEERROR_QUERY, HPWMI_WRITE, &t, sizeof(t), 0); return r ? (r < 0 ? r : -EINVAL) : c; }
-static DEVICE_ATTR_RO(display); static DEVICE_ATTR_RO(hddtemp); static DEVICE_ATTR_RW(als);
-static DEVICE_ATTR_RO(dock); static DEVICE_ATTR_RO(tablet); static DEVICE_ATTR_RW(postcode);
-static struct attribute *hp_wmi_attrs[] = {&dev_attr_display.attr, &dev_attr_hddtemp.attr, &dev_attr_als.attr, &dev_attr_dock.attr, &dev_attr_tablet.attr, &dev_attr_postcode.attr, NULL};
-ATTRIBUTE_GROUPS(hp_wmi);
-static int hp_wmi_get_dock_state(void) { int s = hp_wmi_read_int(HPWMI_HARDWARE_QUERY); return (s < 0) ? s : !!(s & HPWMI_DOCK_MASK); }
-static int hp_wmi_get_tablet_mode(void) {
-	char sdm[4] = {0}; const char *ct = dmi_get_system_info(DMI_CHASSIS_TYPE); int r;
-	if (!ct) return -ENODEV;
-	if (match_string(tablet_chassis_types, ARRAY_SIZE(tablet_chassis_types), ct) < 0) return -ENODEV;
-	r = hp_wmi_perform_query(HPWMI_SYSTEM_DEVICE_MODE, HPWMI_READ, sdm, 0, sizeof(sdm)); return r < 0 ? r : (sdm[0] == DEVICE_MODE_TABLET);
+
+static void hp_wmi_neg_record(int query, enum hp_wmi_command command, int ret)
+{
+	int slot = hp_wmi_neg_slot(command);
+
+	if (slot < 0 || query < 0 || query > 0xff)
+		return;
+	if (ret == HPWMI_RET_UNKNOWN_COMMAND)
+		set_bit(slot, hp_wmi_unsupported_cmd);
+	else if (ret == HPWMI_RET_UNKNOWN_CMDTYPE)
+		set_bit(slot * 256 + query, hp_wmi_unsupported);
 }
-static void hp_wmi_notify(union acpi_object *obj, void *context) {
-	u32 eid, edata, *loc; int kc, tm;
-	if (!obj || obj->type != ACPI_TYPE_BUFFER) { pr_info("Unk WMI evt type %d\n", obj ? obj->type : -1); return; }
-	loc = (u32 *)obj->buffer.pointer;
-	if (obj->buffer.length == 8) { eid = loc[0]; edata = loc[1]; }
-	else if (obj->buffer.length == 16) { eid = loc[0]; edata = loc[2]; }
-	else { pr_info("Unk WMI evt len %d\n", obj->buffer.length); return; }
 
-	switch (eid) {
-	case HPWMI_DOCK_EVENT:
-		if (test_bit(SW_DOCK, hp_wmi_input_dev->swbit))
-			input_report_switch(hp_wmi_input_dev, SW_DOCK, hp_wmi_get_dock_state());
-		if (enable_tablet_mode_sw != 0) {
-			tm = hp_wmi_get_tablet_mode();
-			if (tm >= 0) {
-				if (!test_bit(SW_TABLET_MODE, hp_wmi_input_dev->swbit))
-					__set_bit(SW_TABLET_MODE, hp_wmi_input_dev->swbit);
-				input_report_switch(hp_wmi_input_dev, SW_TABLET_MODE, tm);
-			} else if (enable_tablet_mode_sw == 1) {
-				pr_warn("Fail tablet mode SW_TABLET_MODE: %d\n", tm);
-			}
-		}
-		input_sync(hp_wmi_input_dev);
-		break;
-	case HPWMI_PARK_HDD: break;
-	case HPWMI_SMART_ADAPTER: pr_debug("Smart Adapter evt:0x%x\n", edata); break;
-	case HPWMI_BEZEL_BUTTON:
-		kc = hp_wmi_read_int(HPWMI_HOTKEY_QUERY);
-		if (kc < 0 || (kc & HPWMI_HOTKEY_RELEASE_FLAG)) break;
-		if (!sparse_keymap_report_event(hp_wmi_input_dev, kc, 1, true))
-			pr_info("Unk Bezel key:0x%x\n", kc);
-		break;
-	case HPWMI_OMEN_KEY:
-		if (edata != 0 && edata != 0xFFFFFFFF) kc = edata;
-		else kc = hp_wmi_read_int(HPWMI_HOTKEY_QUERY);
-		if (kc < 0 || (kc & HPWMI_HOTKEY_RELEASE_FLAG)) break;
-		if (!sparse_keymap_report_event(hp_wmi_input_dev, kc, 1, true))
-			pr_info("Unk Omen key:0x%x (edata:0x%x)\n", kc, edata);
-		break;
-	case HPWMI_WIRELESS:
-		if (rfkill2_count) { hp_wmi_rfkill2_refresh(); break; }
-		if (wifi_rfkill) rfkill_set_states(wifi_rfkill, hp_wmi_get_sw_state(HPWMI_WIFI), hp_wmi_get_hw_state(HPWMI_WIFI));
-		if (bluetooth_rfkill) rfkill_set_states(bluetooth_rfkill, hp_wmi_get_sw_state(HPWMI_BLUETOOTH), hp_wmi_get_hw_state(HPWMI_BLUETOOTH));
-		if (wwan_rfkill) rfkill_set_states(wwan_rfkill, hp_wmi_get_sw_state(HPWMI_WWAN), hp_wmi_get_hw_state(HPWMI_WWAN));
-		break;
-	case HPWMI_CPU_BATTERY_THROTTLE: pr_info("CPU throttle evt (data:0x%x)\n", edata); break;
-	case HPWMI_LOCK_SWITCH: pr_debug("Lock switch evt:0x%x\n", edata); break;
-	case HPWMI_LID_SWITCH: pr_debug("Lid evt:0x%x\n", edata); break;
-	case HPWMI_SCREEN_ROTATION: pr_debug("Screen rotation evt:0x%x\n", edata); break;
-	case HPWMI_COOLSENSE_SYSTEM_MOBILE: case HPWMI_COOLSENSE_SYSTEM_HOT: pr_debug("Coolsense evt:ID 0x%x,Data 0x%x\n", eid, edata); break;
-	case HPWMI_PROXIMITY_SENSOR: pr_debug("Proximity evt:0x%x\n", edata); break;
-	case HPWMI_BACKLIT_KB_BRIGHTNESS: pr_debug("KB backlight evt:0x%x\n", edata); break;
-	case HPWMI_PEAKSHIFT_PERIOD: case HPWMI_BATTERY_CHARGE_PERIOD: pr_debug("Battery evt:ID 0x%x,Data 0x%x\n", eid, edata); break;
-	case HPWMI_SANITIZATION_MODE: pr_info("Sanitization evt:0x%x\n", edata); break;
-	case HPWMI_CAMERA_TOGGLE:
-		if (!camera_shutter_input_dev) {
-			if (camera_shutter_input_setup())
-				pr_err("Fail cam shutter setup\n");
-		}
-		if (camera_shutter_input_dev) {
-			if (edata == 0xff) input_report_switch(camera_shutter_input_dev, SW_CAMERA_LENS_COVER, 1);
-			else if (edata == 0xfe) input_report_switch(camera_shutter_input_dev, SW_CAMERA_LENS_COVER, 0);
-			else pr_warn("Unk cam shutter state:0x%x\n", edata);
-			input_sync(camera_shutter_input_dev);
+static int unsupported_show(struct seq_file *m, void *unused)
+{
+	int i, q;
+
+	for (i = 0; i < HPWMI_NEG_COMMANDS; i++) {
+		if (test_bit(i, hp_wmi_unsupported_cmd)) {
+			seq_printf(m, "0x%x *\n", hp_wmi_neg_commands[i]);
+			continue;
 		}
-		break;
-	case HPWMI_SMART_EXPERIENCE_APP: pr_info("Smart Exp App evt:0x%x\n", edata); break;
-	default: pr_info("Unk WMI evt_id:0x%x,data:0x%x\n", eid, edata); break;
+		for (q = 0; q < 256; q++)
+			if (test_bit(i * 256 + q, hp_wmi_unsupported))
+				seq_printf(m, "0x%x 0x%x\n", hp_wmi_neg_commands[i], q);
 	}
-}
-static int __init hp_wmi_input_setup(void) {
-	acpi_status status; int err, val, tablet_mode;
-	hp_wmi_input_dev = input_allocate_device(); if (!hp_wmi_input_dev) return -ENOMEM;
-	hp_wmi_input_dev->name = "HP WMI hotkeys"; hp_wmi_input_dev->phys = "wmi/input0"; hp_wmi_input_dev->id.bustype = BUS_HOST;
-	err = sparse_keymap_setup(hp_wmi_input_dev, hp_wmi_keymap, NULL); if (err) goto err_free_dev;
-	__set_bit(EV_SW, hp_wmi_input_dev->evbit);
-	val = hp_wmi_get_dock_state(); if (val >= 0) { __set_bit(SW_DOCK, hp_wmi_input_dev->swbit); input_report_switch(hp_wmi_input_dev, SW_DOCK, val); } else pr_warn("Fail init dock state:%d\n", val);
-	if (enable_tablet_mode_sw != 0) { tablet_mode = hp_wmi_get_tablet_mode(); if (tablet_mode >= 0) { __set_bit(SW_TABLET_MODE, hp_wmi_input_dev->swbit); input_report_switch(hp_wmi_input_dev, SW_TABLET_MODE, tablet_mode); } else if (enable_tablet_mode_sw == 1) pr_warn("Fail init tablet SW_TABLET_MODE:%d\n", tablet_mode); }
-	input_sync(hp_wmi_input_dev);
-	if (!hp_wmi_bios_2009_later() && hp_wmi_bios_2008_later()) { err = hp_wmi_enable_hotkeys(); if (err) pr_warn("Fail enable hotkeys:%d\n", err); }
-	status = wmi_install_notify_handler(HPWMI_EVENT_GUID, hp_wmi_notify, NULL); if (ACPI_FAILURE(status)) { pr_err("Fail WMI notify handler:0x%x\n", status); err = -EIO; goto err_free_keymap_and_dev; } // Zmieniona etykieta
-	err = input_register_device(hp_wmi_input_dev); if (err) goto err_uninstall_notifier;
-	return 0; // Sukces
-err_uninstall_notifier: wmi_remove_notify_handler(HPWMI_EVENT_GUID);
-err_free_keymap_and_dev: // Etykieta dla czyszczenia mapy klawiszy (jeśli sparse_keymap_setup się powiodło) i urządzenia
-	// sparse_keymap_free(hp_wmi_input_dev); // Usuwamy, bo nie istnieje
-err_free_dev: input_free_device(hp_wmi_input_dev); hp_wmi_input_dev = NULL; return err;
-}
-static void hp_wmi_input_destroy(void) {
-	if (hp_wmi_input_dev) { wmi_remove_notify_handler(HPWMI_EVENT_GUID); input_unregister_device(hp_wmi_input_dev); hp_wmi_input_dev = NULL; }
-}
-static int __init hp_wmi_rfkill_setup(struct platform_device *device) {
-	int err = 0, wireless = hp_wmi_read_int(HPWMI_WIRELESS_QUERY); if (wireless < 0) { pr_warn("Fail read wireless query rfkill:%d\n", wireless); return wireless; }
-	if (wireless & 1) { wifi_rfkill = rfkill_alloc("hp-wifi", &device->dev, RFKILL_TYPE_WLAN, &hp_wmi_rfkill_ops, (void *)(uintptr_t)HPWMI_WIFI); if (!wifi_rfkill) { err = -ENOMEM; goto err_cleanup; } rfkill_set_states(wifi_rfkill, hp_wmi_get_sw_state(HPWMI_WIFI), hp_wmi_get_hw_state(HPWMI_WIFI)); err = rfkill_register(wifi_rfkill); if (err) goto err_cleanup; }
-	if (wireless & 2) { bluetooth_rfkill = rfkill_alloc("hp-bluetooth", &device->dev, RFKILL_TYPE_BLUETOOTH, &hp_wmi_rfkill_ops, (void *)(uintptr_t)HPWMI_BLUETOOTH); if (!bluetooth_rfkill) { err = -ENOMEM; goto err_cleanup; } rfkill_set_states(bluetooth_rfkill, hp_wmi_get_sw_state(HPWMI_BLUETOOTH), hp_wmi_get_hw_state(HPWMI_BLUETOOTH)); err = rfkill_register(bluetooth_rfkill); if (err) goto err_cleanup; }
-	if (wireless & 4) { wwan_rfkill = rfkill_alloc("hp-wwan", &device->dev, RFKILL_TYPE_WWAN, &hp_wmi_rfkill_ops, (void *)(uintptr_t)HPWMI_WWAN); if (!wwan_rfkill) { err = -ENOMEM; goto err_cleanup; } rfkill_set_states(wwan_rfkill, hp_wmi_get_sw_state(HPWMI_WWAN), hp_wmi_get_hw_state(HPWMI_WWAN)); err = rfkill_register(wwan_rfkill); if (err) goto err_cleanup; }
 	return 0;
-err_cleanup: if (wwan_rfkill) { rfkill_unregister(wwan_rfkill); rfkill_destroy(wwan_rfkill); wwan_rfkill = NULL; } if (bluetooth_rfkill) { rfkill_unregister(bluetooth_rfkill); rfkill_destroy(bluetooth_rfkill); bluetooth_rfkill = NULL; } if (wifi_rfkill) { rfkill_unregister(wifi_rfkill); rfkill_destroy(wifi_rfkill); wifi_rfkill = NULL; } return err;
 }
-static int __init hp_wmi_rfkill2_setup(struct platform_device *device) {
-	struct bios_rfkill2_state s = {0}; int err = 0, i; err = hp_wmi_perform_query(HPWMI_WIRELESS2_QUERY, HPWMI_READ, &s, sizeof(s), sizeof(s)); if (err) return err < 0 ? err : -EINVAL;
-	if (s.count > HPWMI_MAX_RFKILL2_DEVICES) { pr_warn("rfkill2 count %d > max %d\n", s.count, HPWMI_MAX_RFKILL2_DEVICES); return -EINVAL; }
-	for (i = 0; i < s.count; i++) { struct rfkill *rd; enum rfkill_type t; const char *n;
-		switch (s.device[i].radio_type) { case HPWMI_WIFI:t = RFKILL_TYPE_WLAN; n = "hp-wifi2"; break; case HPWMI_BLUETOOTH:t = RFKILL_TYPE_BLUETOOTH; n = "hp-bluetooth2"; break; case HPWMI_WWAN:t = RFKILL_TYPE_WWAN; n = "hp-wwan2"; break; case HPWMI_GPS:t = RFKILL_TYPE_GPS; n = "hp-gps2"; break; default:pr_warn("unk rfkill2 type 0x%x\n", s.device[i].radio_type); continue; }
-		if (!s.device[i].vendor_id && !s.device[i].product_id) { pr_warn("rfkill2 dev %d zero vid/pid (type 0x%x)\n", i, s.device[i].radio_type); continue; }
-		rd = rfkill_alloc(n, &device->dev, t, &hp_wmi_rfkill2_ops, (void *)(uintptr_t)i); if (!rd) { err = -ENOMEM; goto fail; }
-		rfkill2[rfkill2_count].id = s.device[i].rfkill_id; rfkill2[rfkill2_count].num = i; rfkill2[rfkill2_count].rfkill = rd;
-		rfkill_set_states(rd, IS_SWBLOCKED(s.device[i].power), IS_HWBLOCKED(s.device[i].power));
-		if (!(s.device[i].power & HPWMI_POWER_BIOS)) pr_info("rfkill2 dev %s (type 0x%x) blocked by BIOS\n", n, s.device[i].radio_type);
-		err = rfkill_register(rd); if (err) { rfkill_destroy(rd); rfkill2[rfkill2_count].rfkill = NULL; goto fail; } rfkill2_count++;
-	} return 0;
-fail: while (--rfkill2_count >= 0) { if (rfkill2[rfkill2_count].rfkill) { rfkill_unregister(rfkill2[rfkill2_count].rfkill); rfkill_destroy(rfkill2[rfkill2_count].rfkill); rfkill2[rfkill2_count].rfkill = NULL; } } rfkill2_count = 0; return err;
+
+static int unsupported_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, unsupported_show, NULL);
 }
-static int platform_profile_omen_get(struct device *d, enum platform_profile_option *p) { int t = omen_thermal_profile_get(); if (t < 0)return t; switch (t) { case HP_OMEN_THERMAL_PROFILE_PERFORMANCE:*p = PLATFORM_PROFILE_PERFORMANCE; break; case HP_OMEN_THERMAL_PROFILE_DEFAULT:*p = PLATFORM_PROFILE_BALANCED; break; case HP_OMEN_THERMAL_PROFILE_COOL:*p = PLATFORM_PROFILE_COOL; break; default:pr_warn("Unk Omen EC profile:%d\n", t); return -EINVAL; } return 0; }
-static int platform_profile_omen_set(struct device *d, enum platform_profile_option p) { int t; switch (p) { case PLATFORM_PROFILE_PERFORMANCE:t = HP_OMEN_THERMAL_PROFILE_PERFORMANCE; break; case PLATFORM_PROFILE_BALANCED:t = HP_OMEN_THERMAL_PROFILE_DEFAULT; break; case PLATFORM_PROFILE_COOL:t = HP_OMEN_THERMAL_PROFILE_COOL; break; default:return -EINVAL; } return omen_thermal_profile_set(t); }
-static int generic_thermal_profile_get_wmi(void) { return hp_wmi_read_int(HPWMI_THERMAL_PROFILE_QUERY); }
-static int generic_thermal_profile_set_wmi(int tp) { if (tp < 0 || tp > 2)return -EINVAL; return hp_wmi_perform_query(HPWMI_THERMAL_PROFILE_QUERY, HPWMI_WRITE, &tp, sizeof(tp), 0); }
-static int hp_wmi_platform_profile_get(struct device *d, enum platform_profile_option *p) { int t = generic_thermal_profile_get_wmi(); if (t < 0)return t; switch (t) { case HP_THERMAL_PROFILE_PERFORMANCE:*p = PLATFORM_PROFILE_PERFORMANCE; break; case HP_THERMAL_PROFILE_DEFAULT:*p = PLATFORM_PROFILE_BALANCED; break; case HP_THERMAL_PROFILE_COOL:*p = PLATFORM_PROFILE_COOL; break; default:pr_warn("Unk generic WMI profile:%d\n", t); return -EINVAL; } return 0; }
-static int hp_wmi_platform_profile_set(struct device *d, enum platform_profile_option p) { int t; switch (p) { case PLATFORM_PROFILE_PERFORMANCE:t = HP_THERMAL_PROFILE_PERFORMANCE; break; case PLATFORM_PROFILE_BALANCED:t = HP_THERMAL_PROFILE_DEFAULT; break; case PLATFORM_PROFILE_COOL:t = HP_THERMAL_PROFILE_COOL; break; default:return -EINVAL; } return generic_thermal_profile_set_wmi(t); }
 
-#define FOURZONE_COUNT 4
-struct color_platform { u8 b; u8 g; u8 r; } __packed;
-struct platform_zone { u8 offset; struct device_attribute *attr; struct color_platform colors; char *name_ptr; };
-static struct device_attribute *zone_dev_attrs; static struct attribute **zone_attrs; static struct platform_zone *zone_data;
-static struct attribute_group zone_attribute_group = {.name = "rgb_zones"};
-static int parse_rgb(const char *buf, struct color_platform *c) { unsigned long v; int r = kstrtoul(buf, 16, &v); if (r)return r; if (v > 0xFFFFFF)return -EINVAL; sscanf(buf, "%2hhx%2hhx%2hhx", &c->r, &c->g, &c->b); pr_debug("hp-wmi:parsed r:%d g:%d b:%d\n", c->r, c->g, c->b); return 0; }
-static struct platform_zone *match_zone_by_attr(struct device_attribute *a) { int i; if (!zone_data || !zone_dev_attrs)return NULL; for (i = 0; i < FOURZONE_COUNT; i++)if (&zone_dev_attrs[i] == a)return &zone_data[i]; return NULL; }
-static int fourzone_update_led(struct platform_zone *z, bool read_op) { u8 s[128] = {0}; int r = hp_wmi_perform_query(HPWMI_FOURZONE_COLOR_GET, HPWMI_FOURZONE, s, 0, sizeof(s)); if (r) { pr_warn("fourzone_get err 0x%x\n", r); return r < 0 ? r : -EIO; } if (read_op) { z->colors.r = s[z->offset + 0]; z->colors.g = s[z->offset + 1]; z->colors.b = s[z->offset + 2]; } else { s[z->offset + 0] = z->colors.r; s[z->offset + 1] = z->colors.g; s[z->offset + 2] = z->colors.b; r = hp_wmi_perform_query(HPWMI_FOURZONE_COLOR_SET, HPWMI_FOURZONE, s, sizeof(s), 0); if (r) { pr_warn("fourzone_set err 0x%x\n", r); return r < 0 ? r : -EIO; } } return 0; }
-static ssize_t zone_show(struct device *d, struct device_attribute *a, char *b) { struct platform_zone *tz = match_zone_by_attr(a); int r; if (!tz)return -EINVAL; r = fourzone_update_led(tz, true); if (r)return sysfs_emit(b, "Err read zone:%d\n", r); return sysfs_emit(b, "RGB:%02x%02x%02x (R:%d G:%d B:%d)\n", tz->colors.r, tz->colors.g, tz->colors.b, tz->colors.r, tz->colors.g, tz->colors.b); }
-static ssize_t zone_set(struct device *d, struct device_attribute *a, const char *buf, size_t count) { struct platform_zone *tz = match_zone_by_attr(a); struct color_platform nc; int r; if (!tz)return -EINVAL; r = parse_rgb(buf, &nc); if (r)return r; tz->colors = nc; r = fourzone_update_led(tz, false); return r ? r : count; }
-static int fourzone_setup(struct platform_device *pdev) {
-	int zi, err = 0; char nb[16]; if (!quirks || !quirks->fourzone)return 0;
-	zone_dev_attrs = kcalloc(FOURZONE_COUNT, sizeof(*zone_dev_attrs), GFP_KERNEL); if (!zone_dev_attrs)return -ENOMEM;
-	zone_attrs = kcalloc(FOURZONE_COUNT + 1, sizeof(*zone_attrs), GFP_KERNEL); if (!zone_attrs) { kfree(zone_dev_attrs); zone_dev_attrs = NULL; return -ENOMEM; }
-	zone_data = kcalloc(FOURZONE_COUNT, sizeof(*zone_data), GFP_KERNEL); if (!zone_data) { kfree(zone_attrs); zone_attrs = NULL; kfree(zone_dev_attrs); zone_dev_attrs = NULL; return -ENOMEM; }
-	for (zi = 0; zi < FOURZONE_COUNT; zi++) { snprintf(nb, sizeof(nb), "zone%02X_rgb", zi); zone_data[zi].name_ptr = kstrdup(nb, GFP_KERNEL); if (!zone_data[zi].name_ptr) { err = -ENOMEM; goto err_fourzone; } sysfs_attr_init(&zone_dev_attrs[zi].attr); zone_dev_attrs[zi].attr.name = zone_data[zi].name_ptr; zone_dev_attrs[zi].attr.mode = 0644; zone_dev_attrs[zi].show = zone_show; zone_dev_attrs[zi].store = zone_set; zone_data[zi].offset = 25 + (zi * 3); zone_data[zi].attr = &zone_dev_attrs[zi]; zone_attrs[zi] = &zone_dev_attrs[zi].attr; }
-	zone_attrs[FOURZONE_COUNT] = NULL; zone_attribute_group.attrs = zone_attrs; err = sysfs_create_group(&pdev->dev.kobj, &zone_attribute_group); if (err)goto err_fourzone; return 0;
-err_fourzone: for (zi--; zi >= 0; zi--)kfree(zone_data[zi].name_ptr); kfree(zone_data); zone_data = NULL; kfree(zone_attrs); zone_attrs = NULL; kfree(zone_dev_attrs); zone_dev_attrs = NULL; return err;
+/* Writing anything forgets the list, e.g. after injecting errors into the emulator */
+static ssize_t unsupported_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	bitmap_zero(hp_wmi_unsupported, HPWMI_NEG_COMMANDS * 256);
+	bitmap_zero(hp_wmi_unsupported_cmd, HPWMI_NEG_COMMANDS);
+	return count;
 }
-static void fourzone_remove(struct platform_device *pdev) {
-	int i; if (quirks && quirks->fourzone && zone_attribute_group.attrs) { sysfs_remove_group(&pdev->dev.kobj, &zone_attribute_group); if (zone_data)for (i = 0; i < FOURZONE_COUNT; i++)kfree(zone_data[i].name_ptr); kfree(zone_data); zone_data = NULL; kfree(zone_attrs); zone_attrs = NULL; kfree(zone_dev_attrs); zone_dev_attrs = NULL; zone_attribute_group.attrs = NULL; }
+
+static const struct file_operations unsupported_fops = {
+	.owner = THIS_MODULE,
+	.open = unsupported_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = unsupported_write,
+};
+
+static void hp_wmi_debugfs_init(void)
+{
+	hp_wmi_debugfs = debugfs_create_dir("hp-wmi", NULL);
+	debugfs_create_file("query_stats", 0444, hp_wmi_debugfs, NULL, &query_stats_fops);
+	debugfs_create_file("query_latency", 0444, hp_wmi_debugfs, NULL, &query_latency_fops);
+	debugfs_create_file("stats_reset", 0200, hp_wmi_debugfs, NULL, &stats_reset_fops);
+	debugfs_create_file("unsupported", 0600, hp_wmi_debugfs, NULL, &unsupported_fops);
 }
-static int thermal_profile_setup(void) {
-	struct device *dev = &hp_wmi_platform_dev->dev;
-	int err_check, tp_val;
-	unsigned long choices_mask = 0;
-	struct platform_profile_ops *selected_ops;
 
-	set_bit(PLATFORM_PROFILE_COOL, &choices_mask);
-	set_bit(PLATFORM_PROFILE_BALANCED, &choices_mask);
-	set_bit(PLATFORM_PROFILE_PERFORMANCE, &choices_mask);
+static int hp_wmi_ec_read(u8 addr, u8 *val)
+{
+	u64 start = ktime_get_ns(), ns;
+	int r;
 
-	if (is_omen_thermal_profile()) {
-		tp_val = omen_thermal_profile_get();
-		if (tp_val < 0) { pr_warn("Fail get Omen profile:%d\n", tp_val); return tp_val; }
-		err_check = omen_thermal_profile_set(tp_val);
-		if (err_check < 0) { pr_warn("Fail set init Omen profile:%d\n", err_check); return err_check; }
-		hp_wmi_omen_profile_ops.profile_get = platform_profile_omen_get;
-		hp_wmi_omen_profile_ops.profile_set = platform_profile_omen_set;
-		selected_ops = &hp_wmi_omen_profile_ops;
-	} else {
-		tp_val = generic_thermal_profile_get_wmi();
-		if (tp_val < 0) { pr_warn("Fail get generic profile:%d\n", tp_val); return tp_val; }
-		err_check = generic_thermal_profile_set_wmi(tp_val);
-		if (err_check < 0) { pr_warn("Fail set init generic profile(sys err):%d\n", err_check); return err_check; }
-		else if (err_check > 0) { pr_warn("WMI err %d on generic profile set\n", err_check); return -EIO; }
-		hp_wmi_profile_ops.profile_get = hp_wmi_platform_profile_get;
-		hp_wmi_profile_ops.profile_set = hp_wmi_platform_profile_set;
-		selected_ops = &hp_wmi_profile_ops;
-	}
+	*val = 0;
+	r = hp_wmi_transport->ec_read(addr, val);
+	ns = ktime_get_ns() - start;
+	trace_hp_wmi_ec_read(addr, *val, r, ns);
+	scoped_guard(spinlock, &hp_wmi_stats_lock)
+		hp_wmi_stats_account(&hp_wmi_ec_stats, r, ns);
+	return r;
+}
 
-	platform_profile_dev = platform_profile_register(dev, "hp-wmi", &choices_mask, selected_ops);
-	if (IS_ERR(platform_profile_dev)) {
-		pr_err("Fail register platform profile:%ld\n", PTR_ERR(platform_profile_dev));
-		platform_profile_dev = NULL;
-		return PTR_ERR(platform_profile_dev);
+static bool hp_wmi_run_next(void)
+{
+	struct hp_wmi_req *cur;
+	u64 start, ns;
+
+	lockdep_assert_held(&hp_wmi_exec_lock);
+	scoped_guard(spinlock, &hp_wmi_queue_lock) {
+		cur = list_first_entry_or_null(&hp_wmi_queue, struct hp_wmi_req, node);
+		if (!cur)
+			return false;
+		cur->started = true;
 	}
-	platform_profile_support = true;
+	start = ktime_get_ns();
+	trace_hp_wmi_query_start(cur->command, cur->query, cur->insize, cur->outsize);
+	cur->ret = hp_wmi_evaluate(cur);
+	ns = ktime_get_ns() - start;
+	trace_hp_wmi_query_end(cur->command, cur->query, cur->insize, cur->outsize, cur->ret, ns);
+	hp_wmi_stats_query(cur->command, cur->query, cur->ret, ns);
+	scoped_guard(spinlock, &hp_wmi_queue_lock) {
+		list_del(&cur->node);
+		cur->done = true;
+	}
+	return true;
+}
+
+static bool hp_wmi_req_released(struct hp_wmi_req *rq)
+{
+	guard(spinlock)(&hp_wmi_queue_lock);
+	return !rq->sharers;
+}
+
+static int hp_wmi_perform_query(int query, enum hp_wmi_command command, void *buffer, int insize, int outsize) {
+	struct hp_wmi_req rq = { .query = query, .command = command, .insize = insize, .outsize = outsize };
+	struct hp_wmi_req *target = &rq;
+	bool last;
+	int ret;
+
+	if (WARN_ON(insize > sizeof(rq.in))) return -EINVAL;
+	if (WARN_ON(outsize > sizeof(rq.out))) return -EINVAL;
+	ret = hp_wmi_neg_lookup(query, command);
+	if (ret)
+		return ret;
+	if (insize > 0 && buffer) memcpy(rq.in, buffer, insize);
+	if (command == HPWMI_READ || command == HPWMI_WRITE)
+		rq.write = command == HPWMI_WRITE;
+	else
+		rq.write = !outsize;
+
+	scoped_guard(spinlock, &hp_wmi_queue_lock) {
+		target = hp_wmi_find_shared(&rq) ?: &rq;
+		if (target == &rq) {
+			list_add_tail(&rq.node, &hp_wmi_queue);
+		} else {
+			if (rq.write)
+				memcpy(target->in, rq.in, insize);
+			target->sharers++;
+		}
+	}
+	if (target != &rq)
+		hp_wmi_stats_coalesced(command, query);
+
+	scoped_guard(mutex, &hp_wmi_exec_lock) {
+		while (!target->done)
+			if (WARN_ON(!hp_wmi_run_next()))
+				break;
+	}
+
+	if (target != &rq) {
+		scoped_guard(spinlock, &hp_wmi_queue_lock) {
+			ret = target->ret;
+			if (!ret && outsize && buffer)
+				memcpy(buffer, target->out, outsize);
+			last = !--target->sharers;
+		}
+		if (last)
+			wake_up_all(&hp_wmi_req_wq);
+		return ret;
+	}
+
+	if (!rq.ret && outsize && buffer)
+		memcpy(buffer, rq.out, outsize);
+	hp_wmi_neg_record(query, command, rq.ret);
+	/* Sharers copy their result out of our stack frame */
+	wait_event(hp_wmi_req_wq, hp_wmi_req_released(&rq));
+	return rq.ret;
+}
+
+/*
+ * Emulated HP BIOS, selected with emulate=1. It models the GM fan and
+ * performance commands, the FourZone blocks, the legacy and rfkill2
+ * wireless state and the EC thermal profile byte. Per-call latency and
+ * error injection, event injection and a query benchmark live in debugfs.
+ */
+static bool emulate;
+module_param(emulate, bool, 0444);
+MODULE_PARM_DESC(emulate, "Run against an emulated HP BIOS instead of ACPI (for development)");
+static bool emulate_rfkill2;
+module_param(emulate_rfkill2, bool, 0444);
+MODULE_PARM_DESC(emulate_rfkill2, "Emulated BIOS only reports wireless state through rfkill2");
+
+#define HPWMI_EMUL_FANS 2
+static const struct hp_wmi_board hp_wmi_emul_board = { "emulated", HPWMI_BOARD_FOURZONE | HPWMI_BOARD_GM | HPWMI_BOARD_OMEN_THERMAL, HPWMI_EMUL_FANS };
+static int hp_wmi_board_cmp(const void *key, const void *elt)
+{
+	return strcmp(key, ((const struct hp_wmi_board *)elt)->name);
+}
+static const struct hp_wmi_board *hp_wmi_board_lookup(void)
+{
+	const char *bn;
+
+	if (emulate)
+		return &hp_wmi_emul_board;
+	bn = dmi_get_system_info(DMI_BOARD_NAME);
+	if (!bn)
+		return NULL;
+	return bsearch(bn, hp_wmi_boards, ARRAY_SIZE(hp_wmi_boards), sizeof(hp_wmi_boards[0]), hp_wmi_board_cmp);
+}
+struct hp_wmi_emul_state {
+	struct mutex lock;
+	u8 fourzone[128];
+	u8 anim[128];
+	u8 backlight;
+	u16 fan_rpm[HPWMI_EMUL_FANS];
+	u32 fan_max;
+	u8 ec_profile;
+	u32 thermal_profile;
+	u32 hardware, wireless, als;
+	struct hp_wmi_gpu_modes gpu;
+	u32 gpu_mode;
+	struct bios_rfkill2_state rfkill2;
+	u32 latency_us, fail_every, fail_code, calls;
+};
+static struct hp_wmi_emul_state hp_wmi_emul = {
+	.lock = __MUTEX_INITIALIZER(hp_wmi_emul.lock),
+	.backlight = 0xE4,
+	.fan_rpm = { 2300, 2500 },
+	.ec_profile = HP_OMEN_THERMAL_PROFILE_DEFAULT,
+	.thermal_profile = HP_THERMAL_PROFILE_DEFAULT,
+	.gpu = { .ctgp_enable = 1, .ppab_enable = 1, .dstate = 1, .slowdown_temp = 87 },
+	.gpu_mode = HP_GPU_MODE_HYBRID,
+	/* wifi and bluetooth present, neither soft nor hard blocked */
+	.wireless = 0x0a0a03,
+	.rfkill2 = {
+		.count = 2,
+		.device = {
+			{ .radio_type = HPWMI_WIFI, .vendor_id = 0x8086, .product_id = 0x2725, .rfkill_id = 0, .power = 0x0f },
+			{ .radio_type = HPWMI_BLUETOOTH, .vendor_id = 0x8087, .product_id = 0x0032, .rfkill_id = 1, .power = 0x0f },
+		},
+	},
+	.fail_code = HPWMI_RET_INVALID_PARAMETERS,
+};
+
+static int hp_wmi_emul_read(const struct bios_args *args, u8 *out, size_t outlen)
+{
+	struct hp_wmi_emul_state *e = &hp_wmi_emul;
+	u32 v;
+
+	switch (args->commandtype) {
+	case HPWMI_HARDWARE_QUERY: v = e->hardware; break;
+	case HPWMI_WIRELESS_QUERY:
+		if (emulate_rfkill2)
+			return HPWMI_RET_UNKNOWN_CMDTYPE;
+		v = e->wireless;
+		break;
+	case HPWMI_DISPLAY_QUERY: v = 1; break;
+	case HPWMI_HDDTEMP_QUERY: v = 38; break;
+	case HPWMI_ALS_QUERY: v = e->als; break;
+	case HPWMI_THERMAL_PROFILE_QUERY: v = e->thermal_profile; break;
+	case HPWMI_GPU_MODE_QUERY: v = e->gpu_mode; break;
+	case HPWMI_FEATURE_QUERY: case HPWMI_FEATURE2_QUERY: case HPWMI_HOTKEY_QUERY:
+	case HPWMI_POSTCODEERROR_QUERY: case HPWMI_SYSTEM_DEVICE_MODE:
+		v = 0;
+		break;
+	case HPWMI_WIRELESS2_QUERY:
+		memcpy(out, &e->rfkill2, min(outlen, sizeof(e->rfkill2)));
+		return 0;
+	default:
+		return HPWMI_RET_UNKNOWN_CMDTYPE;
+	}
+	memcpy(out, &v, min(outlen, sizeof(v)));
+	return 0;
+}
+
+static int hp_wmi_emul_write(const struct bios_args *args)
+{
+	struct hp_wmi_emul_state *e = &hp_wmi_emul;
+	const u8 *in = args->data;
+	u32 v;
+	int i;
+
+	memcpy(&v, in, sizeof(v));
+	switch (args->commandtype) {
+	case HPWMI_WIRELESS_QUERY:
+		for (i = HPWMI_WIFI; i <= HPWMI_WWAN; i++) {
+			if (!(v & BIT(i + 8)))
+				continue;
+			if (v & BIT(i))
+				e->wireless |= 0x200 << (i * 8);
+			else
+				e->wireless &= ~(0x200 << (i * 8));
+		}
+		return 0;
+	case HPWMI_WIRELESS2_QUERY:
+		if (in[2] >= e->rfkill2.count)
+			return HPWMI_RET_INVALID_PARAMETERS;
+		if (in[3])
+			e->rfkill2.device[in[2]].power |= HPWMI_POWER_SOFT;
+		else
+			e->rfkill2.device[in[2]].power &= ~HPWMI_POWER_SOFT;
+		return 0;
+	case HPWMI_ALS_QUERY:
+		e->als = v;
+		return 0;
+	case HPWMI_THERMAL_PROFILE_QUERY:
+		if (v > HP_THERMAL_PROFILE_COOL)
+			return HPWMI_RET_INVALID_PARAMETERS;
+		e->thermal_profile = v;
+		return 0;
+	case HPWMI_GPU_MODE_QUERY:
+		if (v > HP_GPU_MODE_DISCRETE)
+			return HPWMI_RET_INVALID_PARAMETERS;
+		e->gpu_mode = v;
+		return 0;
+	case HPWMI_BIOS_QUERY: case HPWMI_POSTCODEERROR_QUERY:
+		return 0;
+	default:
+		return HPWMI_RET_UNKNOWN_CMDTYPE;
+	}
+}
+
+static int hp_wmi_emul_gm(const struct bios_args *args, u8 *out, size_t outlen)
+{
+	struct hp_wmi_emul_state *e = &hp_wmi_emul;
+	const u8 *in = args->data;
+	u16 rpm;
+	int i;
+
+	switch (args->commandtype) {
+	case HPWMI_FAN_SPEED_GET_QUERY:
+		if (in[0] >= HPWMI_EMUL_FANS)
+			return HPWMI_RET_INVALID_PARAMETERS;
+		rpm = e->fan_max ? 5500 + in[0] * 300 : e->fan_rpm[in[0]];
+		out[2] = rpm >> 8;
+		out[3] = rpm & 0xff;
+		return 0;
+	case HPWMI_FAN_COUNT_GET_QUERY:
+		out[0] = HPWMI_EMUL_FANS;
+		return 0;
+	case HPWMI_FAN_LEVEL_GET_QUERY:
+		for (i = 0; i < HPWMI_EMUL_FANS; i++)
+			out[i] = (e->fan_max ? 5500 + i * 300 : e->fan_rpm[i]) / 100;
+		return 0;
+	case HPWMI_FAN_LEVEL_SET_QUERY:
+		/* Level 0 hands the fan back to the (fixed) emulated BIOS curve */
+		for (i = 0; i < HPWMI_EMUL_FANS; i++)
+			e->fan_rpm[i] = in[i] ? in[i] * 100 : 2300 + i * 200;
+		return 0;
+	case HPWMI_FAN_SPEED_MAX_GET_QUERY:
+		memcpy(out, &e->fan_max, min(outlen, sizeof(e->fan_max)));
+		return 0;
+	case HPWMI_FAN_SPEED_MAX_SET_QUERY:
+		memcpy(&e->fan_max, in, sizeof(e->fan_max));
+		return 0;
+	case HPWMI_SET_PERFORMANCE_MODE:
+		if (in[1] > HP_OMEN_THERMAL_PROFILE_COOL)
+			return HPWMI_RET_INVALID_PARAMETERS;
+		e->ec_profile = in[1];
+		return 0;
+	case HPWMI_GPU_MODES_GET_QUERY:
+		memcpy(out, &e->gpu, min(outlen, sizeof(e->gpu)));
+		return 0;
+	case HPWMI_GPU_MODES_SET_QUERY:
+		if (in[0] > 1 || in[1] > 1 || in[2] < 1 || in[2] > 4)
+			return HPWMI_RET_INVALID_PARAMETERS;
+		/* The slowdown temperature is firmware-owned */
+		e->gpu.ctgp_enable = in[0];
+		e->gpu.ppab_enable = in[1];
+		e->gpu.dstate = in[2];
+		return 0;
+	default:
+		return HPWMI_RET_UNKNOWN_CMDTYPE;
+	}
+}
+
+static int hp_wmi_emul_fourzone(const struct bios_args *args, u8 *out, size_t outlen)
+{
+	struct hp_wmi_emul_state *e = &hp_wmi_emul;
+
+	switch (args->commandtype) {
+	case HPWMI_FOURZONE_COLOR_GET: memcpy(out, e->fourzone, min(outlen, sizeof(e->fourzone))); return 0;
+	case HPWMI_FOURZONE_COLOR_SET: memcpy(e->fourzone, args->data, sizeof(e->fourzone)); return 0;
+	case HPWMI_FOURZONE_BRIGHT_GET: out[0] = e->backlight; return 0;
+	case HPWMI_FOURZONE_BRIGHT_SET: e->backlight = args->data[0]; return 0;
+	case HPWMI_FOURZONE_ANIM_GET: memcpy(out, e->anim, min(outlen, sizeof(e->anim))); return 0;
+	case HPWMI_FOURZONE_ANIM_SET: memcpy(e->anim, args->data, sizeof(e->anim)); return 0;
+	default: return HPWMI_RET_UNKNOWN_CMDTYPE;
+	}
+}
+
+static acpi_status hp_wmi_emul_evaluate(u32 method_id, const struct acpi_buffer *in, struct acpi_buffer *out)
+{
+	static const size_t reply_size[] = { 0, 0, 4, 128, 1024, 4096 };
+	struct hp_wmi_emul_state *e = &hp_wmi_emul;
+	const struct bios_args *args = in->pointer;
+	union acpi_object *obj = out->pointer;
+	struct bios_return *br;
+	size_t len;
+	u8 *data;
+	int ret;
+
+	if (method_id < 1 || method_id >= ARRAY_SIZE(reply_size) || in->length < sizeof(*args))
+		return AE_BAD_PARAMETER;
+	len = sizeof(*br) + reply_size[method_id];
+	if (out->length < sizeof(*obj) + len) {
+		out->length = sizeof(*obj) + len;
+		return AE_BUFFER_OVERFLOW;
+	}
+	if (READ_ONCE(e->latency_us))
+		fsleep(READ_ONCE(e->latency_us));
+
+	br = (struct bios_return *)(obj + 1);
+	data = (u8 *)(br + 1);
+	memset(br, 0, len);
+	scoped_guard(mutex, &e->lock) {
+		if (e->fail_every && !(++e->calls % e->fail_every))
+			ret = e->fail_code;
+		else if (args->signature != 0x55434553)
+			ret = HPWMI_RET_WRONG_SIGNATURE;
+		else if (args->command == HPWMI_READ)
+			ret = hp_wmi_emul_read(args, data, reply_size[method_id]);
+		else if (args->command == HPWMI_WRITE)
+			ret = hp_wmi_emul_write(args);
+		else if (args->command == HPWMI_GM)
+			ret = hp_wmi_emul_gm(args, data, reply_size[method_id]);
+		else if (args->command == HPWMI_FOURZONE)
+			ret = hp_wmi_emul_fourzone(args, data, reply_size[method_id]);
+		else
+			ret = HPWMI_RET_UNKNOWN_COMMAND;
+	}
+	br->return_code = ret;
+	obj->type = ACPI_TYPE_BUFFER;
+	obj->buffer.length = len;
+	obj->buffer.pointer = (u8 *)br;
+	return AE_OK;
+}
+
+static int hp_wmi_emul_ec_read(u8 addr, u8 *val)
+{
+	guard(mutex)(&hp_wmi_emul.lock);
+	*val = addr == HP_OMEN_EC_THERMAL_PROFILE_OFFSET ? hp_wmi_emul.ec_profile : 0;
+	return 0;
+}
+
+static const struct hp_wmi_transport hp_wmi_emul_transport = {
+	.name = "emulated",
+	.evaluate = hp_wmi_emul_evaluate,
+	.ec_read = hp_wmi_emul_ec_read,
+};
+
+static void hp_wmi_notify(union acpi_object *obj, void *context);
+
+/* "<event_id> <event_data>" in hex, delivered as if it came from the BIOS */
+static ssize_t emul_event_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	u32 ev[2];
+	union acpi_object obj = { .buffer = { .type = ACPI_TYPE_BUFFER, .length = sizeof(ev), .pointer = (u8 *)ev } };
+	char buf[32];
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	if (sscanf(buf, "%x %x", &ev[0], &ev[1]) != 2)
+		return -EINVAL;
+	if (!hp_wmi_input_dev)
+		return -ENODEV;
+	hp_wmi_notify(&obj, NULL);
+	return count;
+}
+
+static const struct file_operations emul_event_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = emul_event_write,
+};
+
+/*
+ * Query benchmark: write "<command> <commandtype> <iterations>" (hex, hex,
+ * decimal) to run that read through the full dispatcher path, then read the
+ * file for the result. Only read-only commands are accepted.
+ */
+struct hp_wmi_bench_result {
+	u32 command, query, iterations, errors;
+	u64 total_ns, min_ns, max_ns;
+	u32 hist[HPWMI_LAT_BUCKETS];
+};
+static struct hp_wmi_bench_result hp_wmi_bench;
+static DEFINE_MUTEX(hp_wmi_bench_lock);
+
+static int hp_wmi_bench_outsize(u32 command, u32 query)
+{
+	switch (command) {
+	case HPWMI_READ:
+		return query == HPWMI_WIRELESS2_QUERY ? sizeof(struct bios_rfkill2_state) : sizeof(u32);
+	case HPWMI_GM:
+		if (query == HPWMI_FAN_LEVEL_GET_QUERY)
+			return 128;
+		return query == HPWMI_FAN_COUNT_GET_QUERY || query == HPWMI_FAN_SPEED_GET_QUERY ||
+		       query == HPWMI_FAN_SPEED_MAX_GET_QUERY ? sizeof(u32) : -EINVAL;
+	case HPWMI_FOURZONE:
+		if (query == HPWMI_FOURZONE_COLOR_GET || query == HPWMI_FOURZONE_ANIM_GET)
+			return 128;
+		return query == HPWMI_FOURZONE_BRIGHT_GET ? sizeof(u32) : -EINVAL;
+	default:
+		return -EINVAL;
+	}
+}
+
+static ssize_t bench_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct hp_wmi_bench_result res = { .min_ns = U64_MAX };
+	u8 data[128];
+	char buf[48];
+	int outsize;
+	u64 start, ns, us;
+	u32 i;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	if (sscanf(buf, "%x %x %u", &res.command, &res.query, &res.iterations) != 3)
+		return -EINVAL;
+	if (!res.iterations || res.iterations > 1000000)
+		return -EINVAL;
+	outsize = hp_wmi_bench_outsize(res.command, res.query);
+	if (outsize < 0)
+		return outsize;
+
+	guard(mutex)(&hp_wmi_bench_lock);
+	for (i = 0; i < res.iterations; i++) {
+		memset(data, 0, sizeof(data));
+		start = ktime_get_ns();
+		if (hp_wmi_perform_query(res.query, res.command, data, sizeof(u32), outsize))
+			res.errors++;
+		ns = ktime_get_ns() - start;
+		us = div_u64(ns, NSEC_PER_USEC);
+		res.total_ns += ns;
+		res.min_ns = min(res.min_ns, ns);
+		res.max_ns = max(res.max_ns, ns);
+		res.hist[us ? min_t(int, fls64(us), HPWMI_LAT_BUCKETS - 1) : 0]++;
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+	hp_wmi_bench = res;
+	return count;
+}
+
+static int bench_show(struct seq_file *m, void *unused)
+{
+	struct hp_wmi_bench_result *r = &hp_wmi_bench;
+	int b;
+
+	guard(mutex)(&hp_wmi_bench_lock);
+	if (!r->iterations)
+		return 0;
+	seq_printf(m, "command 0x%x query 0x%x transport %s\n", r->command, r->query, hp_wmi_transport->name);
+	seq_printf(m, "iterations %u errors %u\n", r->iterations, r->errors);
+	seq_printf(m, "min_ns %llu avg_ns %llu max_ns %llu calls_per_sec %llu\n", r->min_ns,
+		   div_u64(r->total_ns, r->iterations), r->max_ns,
+		   r->total_ns ? div64_u64((u64)r->iterations * NSEC_PER_SEC, r->total_ns) : 0);
+	seq_puts(m, "hist");
+	for (b = 0; b < HPWMI_LAT_BUCKETS; b++)
+		seq_printf(m, " %u", r->hist[b]);
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static int bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_show, NULL);
+}
+
+static const struct file_operations bench_fops = {
+	.owner = THIS_MODULE,
+	.open = bench_open,
+	.read = seq_read,
+	.write = bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void hp_wmi_emul_debugfs_init(void)
+{
+	debugfs_create_file("bench", 0600, hp_wmi_debugfs, NULL, &bench_fops);
+	if (!emulate)
+		return;
+	debugfs_create_u32("emul_latency_us", 0600, hp_wmi_debugfs, &hp_wmi_emul.latency_us);
+	debugfs_create_u32("emul_fail_every", 0600, hp_wmi_debugfs, &hp_wmi_emul.fail_every);
+	debugfs_create_u32("emul_fail_code", 0600, hp_wmi_debugfs, &hp_wmi_emul.fail_code);
+	debugfs_create_u8("emul_ec_profile", 0600, hp_wmi_debugfs, &hp_wmi_emul.ec_profile);
+	debugfs_create_u32("emul_hardware", 0600, hp_wmi_debugfs, &hp_wmi_emul.hardware);
+	debugfs_create_u32("emul_wireless", 0600, hp_wmi_debugfs, &hp_wmi_emul.wireless);
+	debugfs_create_file("emul_event", 0200, hp_wmi_debugfs, NULL, &emul_event_fops);
+}
+
+static int hp_wmi_get_fan_speed(int fan) {
+	u8 fsh, fsl; char fan_data[4] = { fan, 0, 0, 0 };
+	if (hp_wmi_perform_query(HPWMI_FAN_SPEED_GET_QUERY, HPWMI_GM, &fan_data, sizeof(fan_data), sizeof(fan_data)) != 0) return -EINVAL;
+	fsh = fan_data[2]; fsl = fan_data[3]; return (fsh << 8) | fsl;
+}
+
+/*
+ * Result cache for the plain HPWMI_READ queries that barely change. Entries
+ * expire after their TTL and are dropped early by the WMI event that reports
+ * a change. The generation count keeps a read that raced with an
+ * invalidation from storing its stale result.
+ */
+enum hp_wmi_cache_slot { HPWMI_CACHE_DISPLAY, HPWMI_CACHE_HDDTEMP, HPWMI_CACHE_ALS, HPWMI_CACHE_HARDWARE, HPWMI_CACHE_WIRELESS, HPWMI_CACHE_COUNT };
+static const int hp_wmi_cache_query[HPWMI_CACHE_COUNT] = {
+	[HPWMI_CACHE_DISPLAY] = HPWMI_DISPLAY_QUERY, [HPWMI_CACHE_HDDTEMP] = HPWMI_HDDTEMP_QUERY,
+	[HPWMI_CACHE_ALS] = HPWMI_ALS_QUERY, [HPWMI_CACHE_HARDWARE] = HPWMI_HARDWARE_QUERY,
+	[HPWMI_CACHE_WIRELESS] = HPWMI_WIRELESS_QUERY,
+};
+static unsigned int cache_ttl_ms[HPWMI_CACHE_COUNT] = { 1000, 2000, 1000, 5000, 5000 };
+module_param_array(cache_ttl_ms, uint, NULL, 0644);
+MODULE_PARM_DESC(cache_ttl_ms, "Read cache lifetime in ms for display,hddtemp,als,hardware,wireless queries (0=uncached)");
+struct hp_wmi_cache_entry { unsigned long expires; unsigned int gen; int val; bool valid; };
+static struct hp_wmi_cache_entry hp_wmi_cache[HPWMI_CACHE_COUNT];
+static DEFINE_SPINLOCK(hp_wmi_cache_lock);
+
+static int hp_wmi_cache_slot(int query)
+{
+	int i;
+
+	for (i = 0; i < HPWMI_CACHE_COUNT; i++)
+		if (hp_wmi_cache_query[i] == query)
+			return i;
+	return -1;
+}
+
+static void hp_wmi_cache_invalidate(int query)
+{
+	int i = hp_wmi_cache_slot(query);
+
+	if (i < 0)
+		return;
+	guard(spinlock)(&hp_wmi_cache_lock);
+	hp_wmi_cache[i].valid = false;
+	hp_wmi_cache[i].gen++;
+}
+
+static void hp_wmi_cache_invalidate_all(void)
+{
+	int i;
+
+	guard(spinlock)(&hp_wmi_cache_lock);
+	for (i = 0; i < HPWMI_CACHE_COUNT; i++) {
+		hp_wmi_cache[i].valid = false;
+		hp_wmi_cache[i].gen++;
+	}
+}
+
+static int hp_wmi_read_int(int query) {
+	int slot = hp_wmi_cache_slot(query), val = 0, ret;
+	struct hp_wmi_cache_entry *e = slot < 0 ? NULL : &hp_wmi_cache[slot];
+	unsigned int ttl = slot < 0 ? 0 : READ_ONCE(cache_ttl_ms[slot]), gen = 0;
+
+	if (ttl) {
+		guard(spinlock)(&hp_wmi_cache_lock);
+		if (e->valid && time_before(jiffies, e->expires))
+			return e->val;
+		gen = e->gen;
+	}
+	ret = hp_wmi_perform_query(query, HPWMI_READ, &val, sizeof(val), sizeof(val));
+	if (ret)
+		return ret < 0 ? ret : -EINVAL;
+	if (ttl) {
+		guard(spinlock)(&hp_wmi_cache_lock);
+		if (e->gen == gen) {
+			e->val = val;
+			e->expires = jiffies + msecs_to_jiffies(ttl);
+			e->valid = true;
+		}
+	}
+	return val;
+}
+static int hp_wmi_hw_state(int mask) { int s = hp_wmi_read_int(HPWMI_HARDWARE_QUERY); return (s < 0) ? s : !!(s & mask); }
+static int omen_thermal_profile_set(int mode) {
+	char b[2] = {0, mode}; int r; if (mode < 0 || mode > 2) return -EINVAL;
+	r = hp_wmi_perform_query(HPWMI_SET_PERFORMANCE_MODE, HPWMI_GM, &b, sizeof(b), 0); return r ? (r < 0 ? r : -EINVAL) : 0;
+}
+static bool is_omen_thermal_profile(void) { return hp_wmi_board && (hp_wmi_board->flags & HPWMI_BOARD_OMEN_THERMAL); }
+static int omen_thermal_profile_get(void) { u8 d; int r = hp_wmi_ec_read(HP_OMEN_EC_THERMAL_PROFILE_OFFSET, &d); return r < 0 ? r : d; }
+static int hp_wmi_fan_speed_max_set(int en) { int v = en, r = hp_wmi_perform_query(HPWMI_FAN_SPEED_MAX_SET_QUERY, HPWMI_GM, &v, sizeof(v), 0); return r ? (r < 0 ? r : -EINVAL) : 0; }
+static int hp_wmi_fan_speed_max_get(void) {
+	int v = 0, r = hp_wmi_perform_query(HPWMI_FAN_SPEED_MAX_GET_QUERY, HPWMI_GM, &v, sizeof(v), sizeof(v)); return r ? (r < 0 ? r : -EINVAL) : v;
+}
+
+/*
+ * Fan readings are served from a cache refreshed by a sampler that reads all
+ * fans in one sweep, so hwmon reads never wait on ACPI. The sampler stops when
+ * nobody has read the fans for a while and the next read restarts it.
+ */
+#define HPWMI_MAX_FANS 4
+#define HPWMI_FAN_IDLE_SWEEPS 10
+static const char * const hp_wmi_fan_labels[HPWMI_MAX_FANS] = { "CPU Fan", "GPU Fan", "Fan 3", "Fan 4" };
+static int hp_wmi_fan_count;
+static bool hp_wmi_fan_level_query;	/* per-fan FAN_SPEED_GET missing, use the FAN_LEVEL_GET table */
+static unsigned int hp_wmi_fan_interval_ms = 1000;
+static DEFINE_MUTEX(hp_wmi_fan_lock);
+static int hp_wmi_fan_rpm[HPWMI_MAX_FANS];
+static unsigned long hp_wmi_fan_stamp;	/* jiffies of the last sweep, 0 before the first */
+static unsigned long hp_wmi_fan_last_read;
+/*
+ * Set on remove before the fan works are cancelled. The devm hwmon device
+ * is only torn down after remove, and nothing it calls may re-arm a work
+ * once this is set.
+ */
+static bool hp_wmi_fan_stopping;
+static void hp_wmi_fan_sample_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hp_wmi_fan_work, hp_wmi_fan_sample_work);
+
+static int hp_wmi_fan_level_get(u8 *levels)
+{
+	u8 data[128] = {};
+	int r = hp_wmi_perform_query(HPWMI_FAN_LEVEL_GET_QUERY, HPWMI_GM, data, sizeof(u32), sizeof(data));
+
+	if (r)
+		return r < 0 ? r : -EINVAL;
+	memcpy(levels, data, HPWMI_MAX_FANS);
+	return 0;
+}
+
+/* Ask the BIOS how many fans there are; older firmware only answers per-index reads. */
+static void hp_wmi_fan_probe(void)
+{
+	u8 data[4] = {}, levels[HPWMI_MAX_FANS];
+	int i;
+
+	hp_wmi_fan_count = 0;
+	if (!hp_wmi_board_may(HPWMI_BOARD_GM))
+		return;
+	if (hp_wmi_board && hp_wmi_board->fans)
+		hp_wmi_fan_count = min_t(int, hp_wmi_board->fans, HPWMI_MAX_FANS);
+	else if (!hp_wmi_perform_query(HPWMI_FAN_COUNT_GET_QUERY, HPWMI_GM, data, sizeof(data), sizeof(data)))
+		hp_wmi_fan_count = min_t(int, data[0], HPWMI_MAX_FANS);
+	else
+		for (hp_wmi_fan_count = 0; hp_wmi_fan_count < HPWMI_MAX_FANS; hp_wmi_fan_count++)
+			if (hp_wmi_get_fan_speed(hp_wmi_fan_count) < 0)
+				break;
+
+	if (hp_wmi_fan_count && hp_wmi_get_fan_speed(0) < 0) {
+		hp_wmi_fan_level_query = !hp_wmi_fan_level_get(levels);
+		if (!hp_wmi_fan_level_query)
+			hp_wmi_fan_count = 0;
+	}
+	for (i = 0; i < hp_wmi_fan_count; i++)
+		hp_wmi_fan_rpm[i] = -ENODATA;
+	pr_debug("%d fan(s)%s\n", hp_wmi_fan_count, hp_wmi_fan_level_query ? ", level table" : "");
+}
+
+static void hp_wmi_fan_sweep(void)
+{
+	int rpm[HPWMI_MAX_FANS], i, r = 0;
+	u8 levels[HPWMI_MAX_FANS];
+
+	if (hp_wmi_fan_level_query)
+		r = hp_wmi_fan_level_get(levels);
+	for (i = 0; i < hp_wmi_fan_count; i++) {
+		if (hp_wmi_fan_level_query)
+			rpm[i] = r ?: levels[i] * 100;
+		else
+			rpm[i] = hp_wmi_get_fan_speed(i);
+	}
+	guard(mutex)(&hp_wmi_fan_lock);
+	memcpy(hp_wmi_fan_rpm, rpm, hp_wmi_fan_count * sizeof(*rpm));
+	hp_wmi_fan_stamp = jiffies ?: 1;
+}
+
+static void hp_wmi_fan_sample_work(struct work_struct *work)
+{
+	unsigned long interval = msecs_to_jiffies(READ_ONCE(hp_wmi_fan_interval_ms));
+
+	hp_wmi_fan_sweep();
+	if (time_before(jiffies, READ_ONCE(hp_wmi_fan_last_read) + HPWMI_FAN_IDLE_SWEEPS * interval))
+		queue_delayed_work(system_freezable_wq, &hp_wmi_fan_work, interval);
+}
+
+static void hp_wmi_fan_rearm(unsigned long delay)
+{
+	guard(mutex)(&hp_wmi_fan_lock);
+	if (!hp_wmi_fan_stopping)
+		mod_delayed_work(system_freezable_wq, &hp_wmi_fan_work, delay);
+}
+
+static int hp_wmi_fan_cached(int fan, long *val)
+{
+	unsigned long interval = msecs_to_jiffies(READ_ONCE(hp_wmi_fan_interval_ms));
+	bool stale;
+	int rpm;
+
+	WRITE_ONCE(hp_wmi_fan_last_read, jiffies);
+	scoped_guard(mutex, &hp_wmi_fan_lock)
+		stale = !hp_wmi_fan_stamp || time_after(jiffies, hp_wmi_fan_stamp + 2 * interval);
+	/* The sampler went idle: refresh now and restart it */
+	if (stale) {
+		hp_wmi_fan_sweep();
+		hp_wmi_fan_rearm(interval);
+	}
+	scoped_guard(mutex, &hp_wmi_fan_lock)
+		rpm = hp_wmi_fan_rpm[fan];
+	if (rpm < 0)
+		return rpm;
+	*val = rpm;
+	return 0;
+}
+
+/*
+ * Fan curve engine. With pwm_enable = 3 a control loop reads the selected
+ * thermal zone and drives every fan from its own temperature/pwm table through
+ * FAN_LEVEL_SET; pwm_enable = 1 applies pwmN as is. The BIOS only has one fan
+ * mode for the whole machine, so pwm1_enable applies to all fans. A level of
+ * 0 lets the BIOS choose the speed again. The BIOS drops a level it has not
+ * seen for a while, so the loop resends it periodically even when unchanged.
+ */
+#define HPWMI_CURVE_POINTS 8
+#define HPWMI_CURVE_PERIOD_MS 1000
+#define HPWMI_CURVE_REFRESH_TICKS 10
+enum hp_wmi_fan_mode { HPWMI_FAN_MODE_FULL = 0, HPWMI_FAN_MODE_MANUAL = 1, HPWMI_FAN_MODE_BIOS = 2, HPWMI_FAN_MODE_CURVE = 3 };
+static unsigned char fan_max_level = 60;
+module_param(fan_max_level, byte, 0644);
+MODULE_PARM_DESC(fan_max_level, "Fan level (in 100 RPM) that pwm 255 maps to");
+struct hp_wmi_fan_curve {
+	int temp[HPWMI_CURVE_POINTS];	/* millidegree Celsius */
+	u8 pwm[HPWMI_CURVE_POINTS];
+	int hyst;			/* millidegree Celsius */
+	u8 cur;				/* pwm applied by the loop */
+};
+static struct hp_wmi_fan_curve hp_wmi_fan_curves[HPWMI_MAX_FANS];
+static u8 hp_wmi_fan_pwm[HPWMI_MAX_FANS];
+static enum hp_wmi_fan_mode hp_wmi_fan_mode = HPWMI_FAN_MODE_BIOS;
+static bool hp_wmi_fan_mode_user;
+static char hp_wmi_fan_zone[THERMAL_NAME_LENGTH] = "x86_pkg_temp";
+static unsigned int hp_wmi_fan_curve_ticks;
+static DEFINE_MUTEX(hp_wmi_fan_curve_lock);
+static void hp_wmi_fan_curve_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hp_wmi_fan_curve_dwork, hp_wmi_fan_curve_work);
+
+static void hp_wmi_fan_curve_defaults(void)
+{
+	static const int temp[HPWMI_CURVE_POINTS] = { 45000, 55000, 65000, 72000, 78000, 84000, 90000, 95000 };
+	static const u8 pwm[HPWMI_CURVE_POINTS] = { 0, 64, 102, 140, 178, 216, 255, 255 };
+	int i;
+
+	for (i = 0; i < HPWMI_MAX_FANS; i++) {
+		memcpy(hp_wmi_fan_curves[i].temp, temp, sizeof(temp));
+		memcpy(hp_wmi_fan_curves[i].pwm, pwm, sizeof(pwm));
+		hp_wmi_fan_curves[i].hyst = 3000;
+	}
+}
+
+static int hp_wmi_fan_level_set(const u8 *pwm)
+{
+	u8 data[4] = {};
+	int i, r;
+
+	for (i = 0; i < min(hp_wmi_fan_count, (int)sizeof(data)); i++)
+		data[i] = DIV_ROUND_UP(pwm[i] * fan_max_level, 255);
+	r = hp_wmi_perform_query(HPWMI_FAN_LEVEL_SET_QUERY, HPWMI_GM, data, sizeof(data), 0);
+	return r ? (r < 0 ? r : -EINVAL) : 0;
+}
+
+/* pwm of the last point at or below temp */
+static u8 hp_wmi_fan_curve_lookup(const struct hp_wmi_fan_curve *c, int temp)
+{
+	u8 pwm = c->pwm[0];
+	int i;
+
+	for (i = 0; i < HPWMI_CURVE_POINTS && temp >= c->temp[i]; i++)
+		pwm = c->pwm[i];
+	return pwm;
+}
+
+static bool hp_wmi_fan_curves_valid(void)
+{
+	int fan, i;
+
+	guard(mutex)(&hp_wmi_fan_curve_lock);
+	for (fan = 0; fan < hp_wmi_fan_count; fan++)
+		for (i = 1; i < HPWMI_CURVE_POINTS; i++)
+			if (hp_wmi_fan_curves[fan].temp[i] < hp_wmi_fan_curves[fan].temp[i - 1])
+				return false;
+	return true;
+}
+
+static void hp_wmi_fan_curve_work(struct work_struct *work)
+{
+	struct thermal_zone_device *tz;
+	u8 pwm[HPWMI_MAX_FANS] = {};
+	bool changed = false;
+	int i, temp, r;
+
+	guard(mutex)(&hp_wmi_fan_curve_lock);
+	if (hp_wmi_fan_mode != HPWMI_FAN_MODE_CURVE)
+		return;
+
+	tz = thermal_zone_get_zone_by_name(hp_wmi_fan_zone);
+	r = IS_ERR(tz) ? PTR_ERR(tz) : thermal_zone_get_temp(tz, &temp);
+	if (r) {
+		pr_warn_ratelimited("Fan curve: no temperature from %s:%d\n", hp_wmi_fan_zone, r);
+		/* Without a temperature, fail safe to the top of the curve */
+		temp = 125000;
+	}
+
+	for (i = 0; i < hp_wmi_fan_count; i++) {
+		struct hp_wmi_fan_curve *c = &hp_wmi_fan_curves[i];
+		u8 up = hp_wmi_fan_curve_lookup(c, temp), down = hp_wmi_fan_curve_lookup(c, temp + c->hyst);
+
+		/* Speed up at once, slow down only once the temperature is hyst below the point */
+		if (up > c->cur || down < c->cur) {
+			c->cur = up > c->cur ? up : down;
+			changed = true;
+		}
+		pwm[i] = c->cur;
+	}
+	if (changed || ++hp_wmi_fan_curve_ticks >= HPWMI_CURVE_REFRESH_TICKS) {
+		hp_wmi_fan_curve_ticks = 0;
+		r = hp_wmi_fan_level_set(pwm);
+		if (r)
+			pr_warn_ratelimited("Fan curve: level set fail:%d\n", r);
+	}
+	queue_delayed_work(system_freezable_wq, &hp_wmi_fan_curve_dwork, msecs_to_jiffies(HPWMI_CURVE_PERIOD_MS));
+}
+
+static int hp_wmi_fan_mode_set(enum hp_wmi_fan_mode mode)
+{
+	u8 none[HPWMI_MAX_FANS] = {};
+	int i, r;
+
+	if (mode != HPWMI_FAN_MODE_FULL && mode != HPWMI_FAN_MODE_BIOS && !hp_wmi_fan_count)
+		return -EOPNOTSUPP;
+	if (mode == HPWMI_FAN_MODE_CURVE && !hp_wmi_fan_curves_valid())
+		return -EINVAL;
+
+	scoped_guard(mutex, &hp_wmi_fan_curve_lock) {
+		r = hp_wmi_fan_speed_max_set(mode == HPWMI_FAN_MODE_FULL);
+		if (r)
+			return r;
+		switch (mode) {
+		case HPWMI_FAN_MODE_MANUAL:
+			r = hp_wmi_fan_level_set(hp_wmi_fan_pwm);
+			break;
+		case HPWMI_FAN_MODE_CURVE:
+			if (hp_wmi_fan_stopping)
+				return -ENODEV;
+			/* Start from the top, the first tick settles down to the curve */
+			for (i = 0; i < HPWMI_MAX_FANS; i++)
+				hp_wmi_fan_curves[i].cur = U8_MAX;
+			break;
+		default:
+			if (hp_wmi_fan_mode == HPWMI_FAN_MODE_MANUAL || hp_wmi_fan_mode == HPWMI_FAN_MODE_CURVE)
+				r = hp_wmi_fan_level_set(none);
+			break;
+		}
+		if (r)
+			return r;
+		hp_wmi_fan_mode = mode;
+		hp_wmi_fan_mode_user = true;
+		/* Armed under the lock so hp_wmi_fan_stop() cannot slip in between */
+		if (mode == HPWMI_FAN_MODE_CURVE)
+			mod_delayed_work(system_freezable_wq, &hp_wmi_fan_curve_dwork, 0);
+	}
+	if (mode != HPWMI_FAN_MODE_CURVE)
+		cancel_delayed_work_sync(&hp_wmi_fan_curve_dwork);
+	return 0;
+}
+
+/* Put the fan mode chosen through pwm1_enable back after resume */
+static void hp_wmi_fan_restore(void)
+{
+	bool full;
+	int max;
+
+	guard(mutex)(&hp_wmi_fan_curve_lock);
+	if (!hp_wmi_fan_mode_user)
+		return;
+	full = hp_wmi_fan_mode == HPWMI_FAN_MODE_FULL;
+	max = hp_wmi_fan_speed_max_get();
+	if (max >= 0 && !!max != full)
+		hp_wmi_fan_speed_max_set(full);
+	if (hp_wmi_fan_mode == HPWMI_FAN_MODE_MANUAL)
+		hp_wmi_fan_level_set(hp_wmi_fan_pwm);
+	else if (hp_wmi_fan_mode == HPWMI_FAN_MODE_CURVE)
+		hp_wmi_fan_curve_ticks = HPWMI_CURVE_REFRESH_TICKS;
+}
+
+static void hp_wmi_fan_stop(void)
+{
+	enum hp_wmi_fan_mode mode;
+
+	scoped_guard(mutex, &hp_wmi_fan_curve_lock) {
+		scoped_guard(mutex, &hp_wmi_fan_lock)
+			hp_wmi_fan_stopping = true;
+		mode = hp_wmi_fan_mode;
+	}
+	if (mode == HPWMI_FAN_MODE_MANUAL || mode == HPWMI_FAN_MODE_CURVE)
+		hp_wmi_fan_mode_set(HPWMI_FAN_MODE_BIOS);
+	cancel_delayed_work_sync(&hp_wmi_fan_curve_dwork);
+	cancel_delayed_work_sync(&hp_wmi_fan_work);
+}
+
+static int hp_wmi_fan_pwm_get(int fan, long *val)
+{
+	long rpm;
+	int r;
+
+	scoped_guard(mutex, &hp_wmi_fan_curve_lock) {
+		if (hp_wmi_fan_mode == HPWMI_FAN_MODE_MANUAL) { *val = hp_wmi_fan_pwm[fan]; return 0; }
+		if (hp_wmi_fan_mode == HPWMI_FAN_MODE_CURVE) { *val = hp_wmi_fan_curves[fan].cur; return 0; }
+	}
+	/* Under BIOS control report the measured speed on the same scale */
+	r = hp_wmi_fan_cached(fan, &rpm);
+	if (r)
+		return r;
+	*val = fan_max_level ? clamp_val(DIV_ROUND_CLOSEST(rpm * 255, fan_max_level * 100), 0, 255) : 0;
+	return 0;
+}
+
+static int hp_wmi_fan_pwm_set(int fan, long val)
+{
+	if (val < 0 || val > 255)
+		return -EINVAL;
+	guard(mutex)(&hp_wmi_fan_curve_lock);
+	hp_wmi_fan_pwm[fan] = val;
+	return hp_wmi_fan_mode == HPWMI_FAN_MODE_MANUAL ? hp_wmi_fan_level_set(hp_wmi_fan_pwm) : 0;
+}
+
+/*
+ * pwmN_auto_pointM_{temp,pwm}, pwmN_auto_point_temp_hyst and the zone selector.
+ * nr is the fan, index the point with HPWMI_CURVE_PWM set for the pwm half.
+ */
+#define HPWMI_CURVE_PWM 0x10
+#define HPWMI_CURVE_HYST 0xff
+static ssize_t fan_curve_point_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sa = to_sensor_dev_attr_2(attr);
+	struct hp_wmi_fan_curve *c = &hp_wmi_fan_curves[sa->nr];
+
+	guard(mutex)(&hp_wmi_fan_curve_lock);
+	if (sa->index == HPWMI_CURVE_HYST)
+		return sysfs_emit(buf, "%d\n", c->hyst);
+	if (sa->index & HPWMI_CURVE_PWM)
+		return sysfs_emit(buf, "%u\n", c->pwm[sa->index & ~HPWMI_CURVE_PWM]);
+	return sysfs_emit(buf, "%d\n", c->temp[sa->index]);
+}
+
+static ssize_t fan_curve_point_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sa = to_sensor_dev_attr_2(attr);
+	struct hp_wmi_fan_curve *c = &hp_wmi_fan_curves[sa->nr];
+	int val, r;
+
+	r = kstrtoint(buf, 10, &val);
+	if (r)
+		return r;
+	guard(mutex)(&hp_wmi_fan_curve_lock);
+	if (sa->index == HPWMI_CURVE_HYST) {
+		if (val < 0 || val > 20000)
+			return -EINVAL;
+		c->hyst = val;
+	} else if (sa->index & HPWMI_CURVE_PWM) {
+		if (val < 0 || val > 255)
+			return -EINVAL;
+		c->pwm[sa->index & ~HPWMI_CURVE_PWM] = val;
+	} else {
+		if (val < 0 || val > 125000)
+			return -EINVAL;
+		/* Keep the points ascending, the curve may be live */
+		if ((sa->index > 0 && val < c->temp[sa->index - 1]) ||
+		    (sa->index < HPWMI_CURVE_POINTS - 1 && val > c->temp[sa->index + 1]))
+			return -EINVAL;
+		c->temp[sa->index] = val;
+	}
+	return count;
+}
+
+static ssize_t fan_curve_zone_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	guard(mutex)(&hp_wmi_fan_curve_lock);
+	return sysfs_emit(buf, "%s\n", hp_wmi_fan_zone);
+}
+
+static ssize_t fan_curve_zone_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	char name[THERMAL_NAME_LENGTH];
+	struct thermal_zone_device *tz;
+
+	if (strscpy(name, buf, sizeof(name)) < 0)
+		return -EINVAL;
+	strim(name);
+	tz = thermal_zone_get_zone_by_name(name);
+	if (IS_ERR(tz))
+		return PTR_ERR(tz);
+	guard(mutex)(&hp_wmi_fan_curve_lock);
+	strscpy(hp_wmi_fan_zone, name, sizeof(hp_wmi_fan_zone));
+	return count;
+}
+static DEVICE_ATTR_RW(fan_curve_zone);
+
+static struct attribute *hp_wmi_fan_curve_attrs[HPWMI_MAX_FANS * (2 * HPWMI_CURVE_POINTS + 1) + 2];
+static const struct attribute_group hp_wmi_fan_curve_group = { .attrs = hp_wmi_fan_curve_attrs };
+static const struct attribute_group *hp_wmi_fan_curve_groups[] = { &hp_wmi_fan_curve_group, NULL };
+
+static int hp_wmi_fan_curve_attr_add(struct device *dev, int *n, int fan, int index, const char *name)
+{
+	struct sensor_device_attribute_2 *sa;
+
+	if (!name)
+		return -ENOMEM;
+	sa = devm_kzalloc(dev, sizeof(*sa), GFP_KERNEL);
+	if (!sa)
+		return -ENOMEM;
+	sysfs_attr_init(&sa->dev_attr.attr);
+	sa->dev_attr.attr.name = name;
+	sa->dev_attr.attr.mode = 0644;
+	sa->dev_attr.show = fan_curve_point_show;
+	sa->dev_attr.store = fan_curve_point_store;
+	sa->nr = fan;
+	sa->index = index;
+	hp_wmi_fan_curve_attrs[(*n)++] = &sa->dev_attr.attr;
+	return 0;
+}
+
+/* Attributes only exist for the fans the BIOS reported, so build them at probe time. */
+static const struct attribute_group **hp_wmi_fan_curve_setup(struct device *dev)
+{
+	int fan, pt, n = 0;
+
+	hp_wmi_fan_curve_defaults();
+	if (!hp_wmi_fan_count)
+		return NULL;
+	for (fan = 0; fan < hp_wmi_fan_count; fan++) {
+		for (pt = 0; pt < HPWMI_CURVE_POINTS; pt++) {
+			if (hp_wmi_fan_curve_attr_add(dev, &n, fan, pt, devm_kasprintf(dev, GFP_KERNEL, "pwm%d_auto_point%d_temp", fan + 1, pt + 1)) ||
+			    hp_wmi_fan_curve_attr_add(dev, &n, fan, pt | HPWMI_CURVE_PWM, devm_kasprintf(dev, GFP_KERNEL, "pwm%d_auto_point%d_pwm", fan + 1, pt + 1)))
+				return NULL;
+		}
+		if (hp_wmi_fan_curve_attr_add(dev, &n, fan, HPWMI_CURVE_HYST, devm_kasprintf(dev, GFP_KERNEL, "pwm%d_auto_point_temp_hyst", fan + 1)))
+			return NULL;
+	}
+	hp_wmi_fan_curve_attrs[n++] = &dev_attr_fan_curve_zone.attr;
+	hp_wmi_fan_curve_attrs[n] = NULL;
+	return hp_wmi_fan_curve_groups;
+}
+static int hp_wmi_bios_2008_later(void) {
+	int s = 0, r = hp_wmi_perform_query(HPWMI_FEATURE_QUERY, HPWMI_READ, &s, sizeof(s), sizeof(s));
+	return !r ? 1 : ((r == HPWMI_RET_UNKNOWN_CMDTYPE) ? 0 : -ENXIO);
+}
+static int hp_wmi_bios_2009_later(void) {
+	u8 s[128] = {0}; int r = hp_wmi_perform_query(HPWMI_FEATURE2_QUERY, HPWMI_READ, &s, sizeof(s), sizeof(s));
+	return !r ? 1 : ((r == HPWMI_RET_UNKNOWN_CMDTYPE) ? 0 : -ENXIO);
+}
+static int hp_wmi_enable_hotkeys(void) { int v = 0x6e, r = hp_wmi_perform_query(HPWMI_BIOS_QUERY, HPWMI_WRITE, &v, sizeof(v), 0); return r <= 0 ? r : -EINVAL; }
+static int hp_wmi_set_block(void *data, bool blocked) {
+	enum hp_wmi_radio r = (enum hp_wmi_radio)(uintptr_t)data; int q = BIT(r + 8) | ((!blocked) << r);
+	int ret = hp_wmi_perform_query(HPWMI_WIRELESS_QUERY, HPWMI_WRITE, &q, sizeof(q), 0); hp_wmi_cache_invalidate(HPWMI_WIRELESS_QUERY); return ret <= 0 ? ret : -EINVAL;
+}
+static const struct rfkill_ops hp_wmi_rfkill_ops = { .set_block = hp_wmi_set_block };
+static bool hp_wmi_get_sw_state(enum hp_wmi_radio r) {
+	int m = 0x200 << (r * 8), w = hp_wmi_read_int(HPWMI_WIRELESS_QUERY); if (w < 0) { WARN_ONCE(1, "err HPWMI_WIRELESS_QUERY SW"); return true; } return !(w & m);
+}
+static int camera_shutter_input_setup(void) {
+	int err; camera_shutter_input_dev = input_allocate_device(); if (!camera_shutter_input_dev) return -ENOMEM;
+	camera_shutter_input_dev->name = "HP WMI camera shutter"; camera_shutter_input_dev->phys = "wmi/input1"; camera_shutter_input_dev->id.bustype = BUS_HOST;
+	__set_bit(EV_SW, camera_shutter_input_dev->evbit); __set_bit(SW_CAMERA_LENS_COVER, camera_shutter_input_dev->swbit);
+	err = input_register_device(camera_shutter_input_dev); if (err) goto err_free_dev; return 0;
+err_free_dev: input_free_device(camera_shutter_input_dev); camera_shutter_input_dev = NULL; return err;
+}
+static bool hp_wmi_get_hw_state(enum hp_wmi_radio r) {
+	int m = 0x800 << (r * 8), w = hp_wmi_read_int(HPWMI_WIRELESS_QUERY); if (w < 0) { WARN_ONCE(1, "err HPWMI_WIRELESS_QUERY HW"); return true; } return !(w & m);
+}
+static int hp_wmi_rfkill2_set_block(void *data, bool blocked) {
+	int id = (int)(uintptr_t)data; char b[4] = {0x01, 0x00, id, !blocked};
+	int ret = hp_wmi_perform_query(HPWMI_WIRELESS2_QUERY, HPWMI_WRITE, b, sizeof(b), 0); return ret <= 0 ? ret : -EINVAL;
+}
+static const struct rfkill_ops hp_wmi_rfkill2_ops = { .set_block = hp_wmi_rfkill2_set_block };
+static int hp_wmi_rfkill2_refresh(void) {
+	struct bios_rfkill2_state s = {0}; int err, i; err = hp_wmi_perform_query(HPWMI_WIRELESS2_QUERY, HPWMI_READ, &s, sizeof(s), sizeof(s));
+	if (err) return err < 0 ? err : -EINVAL;
+	for (i = 0; i < rfkill2_count; i++) { int num = rfkill2[i].num; struct bios_rfkill2_device_state *ds;
+		if (num >= s.count) { pr_warn("rfkill idx %d OOB (%d)\n", num, s.count); continue; } ds = &s.device[num];
+		if (ds->rfkill_id != rfkill2[i].id) { pr_warn("rfkill config changed\n"); continue; }
+		if (rfkill2[i].rfkill) rfkill_set_states(rfkill2[i].rfkill, IS_SWBLOCKED(ds->power), IS_HWBLOCKED(ds->power));
+	} return 0;
+}
+static ssize_t display_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_read_int(HPWMI_DISPLAY_QUERY); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
+static ssize_t hddtemp_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_read_int(HPWMI_HDDTEMP_QUERY); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
+static ssize_t als_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_read_int(HPWMI_ALS_QUERY); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
+static ssize_t dock_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_hw_state(HPWMI_DOCK_MASK); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
+static ssize_t tablet_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_hw_state(HPWMI_TABLET_MASK); return v < 0 ? v : sysfs_emit(b, "%d\n", v); }
+static ssize_t postcode_show(struct device *d, struct device_attribute *a, char *b) { int v = hp_wmi_read_int(HPWMI_POSTCODEERROR_QUERY); return v < 0 ? v : sysfs_emit(b, "0x%x\n", v); }
+static ssize_t als_store(struct device *d, struct device_attribute *a, const char *b, size_t c) { u32 t; int r = kstrtou32(b, 10, &t); if (r) return r; r = hp_wmi_perform_query(HPWMI_ALS_QUERY, HPWMI_WRITE, &t, sizeof(t), 0); hp_wmi_cache_invalidate(HPWMI_ALS_QUERY); return r ? (r < 0 ? r : -EINVAL) : c; }
+static ssize_t postcode_store(struct device *d, struct device_attribute *a, const char *b, size_t c) { u32 t = 1; bool cl; int r = kstrtobool(b, &cl); if (r) return r; if (!cl) return -EINVAL; r = hp_wmi_perform_query(HPWMI_POSTCODEERROR_QUERY, HPWMI_WRITE, &t, sizeof(t), 0); return r ? (r < 0 ? r : -EINVAL) : c; }
+static DEVICE_ATTR_RO(display); static DEVICE_ATTR_RO(hddtemp); static DEVICE_ATTR_RW(als);
+static DEVICE_ATTR_RO(dock); static DEVICE_ATTR_RO(tablet); static DEVICE_ATTR_RW(postcode);
+static struct attribute *hp_wmi_attrs[] = {&dev_attr_display.attr, &dev_attr_hddtemp.attr, &dev_attr_als.attr, &dev_attr_dock.attr, &dev_attr_tablet.attr, &dev_attr_postcode.attr, NULL};
+static const struct attribute_group hp_wmi_group = { .attrs = hp_wmi_attrs };
+
+/*
+ * Throttle and power event accounting, to tell after the fact whether a slow
+ * run was held back by the firmware. The event data says whether the
+ * condition started (non-zero) or ended (zero). Time spent started is summed
+ * per event, and throttled_ms sums the time any throttling event was active.
+ */
+struct hp_throttle_stat {
+	u32 id;
+	bool throttle;
+	const char *name;
+	u64 count, active_ns;
+	ktime_t last, since;
+	u32 last_data;
+	bool active;
+};
+static struct hp_throttle_stat hp_throttle[] = {
+	{ .id = HPWMI_CPU_BATTERY_THROTTLE, .throttle = true, .name = "cpu_battery_throttle" },
+	{ .id = HPWMI_SMART_ADAPTER, .throttle = true, .name = "smart_adapter" },
+	{ .id = HPWMI_COOLSENSE_SYSTEM_HOT, .throttle = true, .name = "coolsense_hot" },
+	{ .id = HPWMI_COOLSENSE_SYSTEM_MOBILE, .name = "coolsense_mobile" },
+	{ .id = HPWMI_PEAKSHIFT_PERIOD, .name = "peakshift_period" },
+	{ .id = HPWMI_BATTERY_CHARGE_PERIOD, .name = "battery_charge_period" },
+};
+static struct { unsigned int active; ktime_t since; u64 ns; } hp_throttled;
+static DEFINE_MUTEX(hp_throttle_lock);
+
+/* A reset can land between an event's timestamp and its accounting */
+static u64 hp_throttle_span(ktime_t from, ktime_t to) { return ktime_after(to, from) ? ktime_to_ns(ktime_sub(to, from)) : 0; }
+
+/* Called by the event worker with the notify-time timestamp */
+static void hp_wmi_throttle_account(u32 id, u32 data, ktime_t stamp)
+{
+	struct hp_throttle_stat *st = NULL;
+	bool on = data;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hp_throttle); i++)
+		if (hp_throttle[i].id == id)
+			st = &hp_throttle[i];
+	if (!st)
+		return;
+	guard(mutex)(&hp_throttle_lock);
+	st->count++;
+	st->last = stamp;
+	st->last_data = data;
+	if (on && !st->active) {
+		st->active = true;
+		st->since = stamp;
+		if (st->throttle && !hp_throttled.active++)
+			hp_throttled.since = stamp;
+	} else if (!on && st->active) {
+		st->active = false;
+		st->active_ns += hp_throttle_span(st->since, stamp);
+		if (st->throttle && !--hp_throttled.active)
+			hp_throttled.ns += hp_throttle_span(hp_throttled.since, stamp);
+	}
+	trace_hp_wmi_throttle(id, data, st->active, st->count,
+			      st->active_ns + (st->active ? hp_throttle_span(st->since, stamp) : 0));
+}
+
+/* One line per event: name, count, last timestamp (ns), last data, active, active time (ms) */
+static ssize_t events_show(struct device *d, struct device_attribute *a, char *b)
+{
+	ktime_t now = ktime_get();
+	struct hp_throttle_stat *st;
+	int i, len = 0;
+
+	guard(mutex)(&hp_throttle_lock);
+	for (i = 0; i < ARRAY_SIZE(hp_throttle); i++) {
+		st = &hp_throttle[i];
+		len += sysfs_emit_at(b, len, "%s %llu %lld 0x%x %d %llu\n", st->name, st->count,
+				     ktime_to_ns(st->last), st->last_data, st->active,
+				     div_u64(st->active_ns + (st->active ? hp_throttle_span(st->since, now) : 0), NSEC_PER_MSEC));
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(events);
+static ssize_t throttled_ms_show(struct device *d, struct device_attribute *a, char *b)
+{
+	u64 ns;
+
+	guard(mutex)(&hp_throttle_lock);
+	ns = hp_throttled.ns + (hp_throttled.active ? hp_throttle_span(hp_throttled.since, ktime_get()) : 0);
+	return sysfs_emit(b, "%llu\n", div_u64(ns, NSEC_PER_MSEC));
+}
+static DEVICE_ATTR_RO(throttled_ms);
+/* Counters and times start over; conditions still active keep counting from now */
+static ssize_t reset_store(struct device *d, struct device_attribute *a, const char *buf, size_t count)
+{
+	ktime_t now = ktime_get();
+	int i;
+
+	guard(mutex)(&hp_throttle_lock);
+	for (i = 0; i < ARRAY_SIZE(hp_throttle); i++) {
+		hp_throttle[i].count = 0;
+		hp_throttle[i].active_ns = 0;
+		hp_throttle[i].since = now;
+	}
+	hp_throttled.ns = 0;
+	hp_throttled.since = now;
+	return count;
+}
+static DEVICE_ATTR_WO(reset);
+static struct attribute *hp_throttle_attrs[] = { &dev_attr_events.attr, &dev_attr_throttled_ms.attr, &dev_attr_reset.attr, NULL };
+static const struct attribute_group hp_throttle_group = { .name = "throttle", .attrs = hp_throttle_attrs };
+static const struct attribute_group *hp_wmi_groups[] = { &hp_wmi_group, &hp_throttle_group, NULL };
+static int hp_wmi_get_dock_state(void) { int s = hp_wmi_read_int(HPWMI_HARDWARE_QUERY); return (s < 0) ? s : !!(s & HPWMI_DOCK_MASK); }
+static int hp_wmi_get_tablet_mode(void) {
+	char sdm[4] = {0}; const char *ct = dmi_get_system_info(DMI_CHASSIS_TYPE); int r;
+	if (!ct) return -ENODEV;
+	if (match_string(tablet_chassis_types, ARRAY_SIZE(tablet_chassis_types), ct) < 0) return -ENODEV;
+	r = hp_wmi_perform_query(HPWMI_SYSTEM_DEVICE_MODE, HPWMI_READ, sdm, 0, sizeof(sdm)); return r < 0 ? r : (sdm[0] == DEVICE_MODE_TABLET);
+}
+static void fourzone_backlight_changed(void);
+static void hp_wmi_profile_kick(void);
+static void hp_wmi_dock_attrs_changed(void);
+static void hp_wmi_profile_written(int tp);
+static void hp_gov_manual_override(void);
+static void hp_wmi_power_profile_changed(int tp);
+static void hp_wmi_rfkill_refresh(void)
+{
+	int w;
+
+	struct rfkill *rfk[] = { [HPWMI_WIFI] = READ_ONCE(wifi_rfkill), [HPWMI_BLUETOOTH] = READ_ONCE(bluetooth_rfkill), [HPWMI_WWAN] = READ_ONCE(wwan_rfkill) };
+	int i;
+
+	if (READ_ONCE(rfkill2_count)) {
+		hp_wmi_rfkill2_refresh();
+		return;
+	}
+	/* One read carries the soft and hard state of every legacy radio */
+	w = hp_wmi_read_int(HPWMI_WIRELESS_QUERY);
+	if (w < 0)
+		return;
+	for (i = HPWMI_WIFI; i <= HPWMI_WWAN; i++)
+		if (rfk[i])
+			rfkill_set_states(rfk[i], !(w & (0x200 << (i * 8))), !(w & (0x800 << (i * 8))));
+}
+
+static void hp_wmi_dock_refresh(void)
+{
+	int tm;
+
+	/* Events can arrive before the input device is up or after it is gone */
+	if (!hp_wmi_input_dev)
+		return;
+	if (test_bit(SW_DOCK, hp_wmi_input_dev->swbit))
+		input_report_switch(hp_wmi_input_dev, SW_DOCK, hp_wmi_get_dock_state());
+	if (enable_tablet_mode_sw != 0) {
+		tm = hp_wmi_get_tablet_mode();
+		if (tm >= 0) {
+			if (!test_bit(SW_TABLET_MODE, hp_wmi_input_dev->swbit))
+				__set_bit(SW_TABLET_MODE, hp_wmi_input_dev->swbit);
+			input_report_switch(hp_wmi_input_dev, SW_TABLET_MODE, tm);
+		} else if (enable_tablet_mode_sw == 1) {
+			pr_warn("Fail tablet mode SW_TABLET_MODE: %d\n", tm);
+		}
+	}
+	input_sync(hp_wmi_input_dev);
+}
+
+static void hp_wmi_handle_event(u32 eid, u32 edata) {
+	int kc;
+
+	switch (eid) {
+	case HPWMI_PARK_HDD: break;
+	case HPWMI_SMART_ADAPTER: pr_debug("Smart Adapter evt:0x%x\n", edata); break;
+	case HPWMI_BEZEL_BUTTON:
+		kc = hp_wmi_read_int(HPWMI_HOTKEY_QUERY);
+		if (kc < 0 || (kc & HPWMI_HOTKEY_RELEASE_FLAG) || !hp_wmi_input_dev) break;
+		if (!sparse_keymap_report_event(hp_wmi_input_dev, kc, 1, true))
+			pr_info("Unk Bezel key:0x%x\n", kc);
+		break;
+	case HPWMI_OMEN_KEY:
+		if (edata != 0 && edata != 0xFFFFFFFF) kc = edata;
+		else kc = hp_wmi_read_int(HPWMI_HOTKEY_QUERY);
+		if (kc < 0 || (kc & HPWMI_HOTKEY_RELEASE_FLAG) || !hp_wmi_input_dev) break;
+		if (!sparse_keymap_report_event(hp_wmi_input_dev, kc, 1, true))
+			pr_info("Unk Omen key:0x%x (edata:0x%x)\n", kc, edata);
+		break;
+	case HPWMI_CPU_BATTERY_THROTTLE: pr_info("CPU throttle evt (data:0x%x)\n", edata); break;
+	case HPWMI_LOCK_SWITCH: pr_debug("Lock switch evt:0x%x\n", edata); break;
+	case HPWMI_LID_SWITCH: pr_debug("Lid evt:0x%x\n", edata); break;
+	case HPWMI_SCREEN_ROTATION: pr_debug("Screen rotation evt:0x%x\n", edata); break;
+	case HPWMI_COOLSENSE_SYSTEM_MOBILE: case HPWMI_COOLSENSE_SYSTEM_HOT: pr_debug("Coolsense evt:ID 0x%x,Data 0x%x\n", eid, edata); break;
+	case HPWMI_PROXIMITY_SENSOR: pr_debug("Proximity evt:0x%x\n", edata); break;
+	case HPWMI_PEAKSHIFT_PERIOD: case HPWMI_BATTERY_CHARGE_PERIOD: pr_debug("Battery evt:ID 0x%x,Data 0x%x\n", eid, edata); break;
+	case HPWMI_SANITIZATION_MODE: pr_info("Sanitization evt:0x%x\n", edata); break;
+	case HPWMI_CAMERA_TOGGLE:
+		if (!camera_shutter_input_dev) {
+			if (camera_shutter_input_setup())
+				pr_err("Fail cam shutter setup\n");
+		}
+		if (camera_shutter_input_dev) {
+			if (edata == 0xff) input_report_switch(camera_shutter_input_dev, SW_CAMERA_LENS_COVER, 1);
+			else if (edata == 0xfe) input_report_switch(camera_shutter_input_dev, SW_CAMERA_LENS_COVER, 0);
+			else pr_warn("Unk cam shutter state:0x%x\n", edata);
+			input_sync(camera_shutter_input_dev);
+		}
+		break;
+	case HPWMI_SMART_EXPERIENCE_APP: pr_info("Smart Exp App evt:0x%x\n", edata); break;
+	default: pr_info("Unk WMI evt_id:0x%x,data:0x%x\n", eid, edata); break;
+	}
+}
+
+/*
+ * Event pipeline. The ACPI notify callback only timestamps the raw event and
+ * puts it in a ring; a worker drains the ring in batches, collapses bursts of
+ * state-change events (dock, wireless, backlight) into one refresh each and
+ * handles everything else in arrival order. Only the producer side takes a
+ * lock, to serialise notifiers; the worker is the single consumer.
+ */
+struct hp_wmi_event { u32 id; u32 data; ktime_t stamp; };
+#define HPWMI_EVENT_RING_SIZE 64
+#define HPWMI_EVENT_BATCH 16
+static DEFINE_KFIFO(hp_wmi_event_ring, struct hp_wmi_event, HPWMI_EVENT_RING_SIZE);
+static DEFINE_SPINLOCK(hp_wmi_event_lock);
+static void hp_wmi_event_work_fn(struct work_struct *work);
+static DECLARE_WORK(hp_wmi_event_work, hp_wmi_event_work_fn);
+
+static void hp_wmi_event_work_fn(struct work_struct *work)
+{
+	struct hp_wmi_event ev[HPWMI_EVENT_BATCH];
+	bool dock, wireless, backlight, profile;
+	unsigned int n, i;
+
+	do {
+		n = kfifo_out(&hp_wmi_event_ring, ev, ARRAY_SIZE(ev));
+		dock = wireless = backlight = profile = false;
+		for (i = 0; i < n; i++) {
+			trace_hp_wmi_event(ev[i].id, ev[i].data, ktime_to_ns(ktime_sub(ktime_get(), ev[i].stamp)));
+			hp_wmi_throttle_account(ev[i].id, ev[i].data, ev[i].stamp);
+			switch (ev[i].id) {
+			case HPWMI_DOCK_EVENT:
+				dock = true;
+				break;
+			case HPWMI_WIRELESS:
+				wireless = true;
+				break;
+			case HPWMI_BACKLIT_KB_BRIGHTNESS:
+				pr_debug("KB backlight evt:0x%x\n", ev[i].data);
+				backlight = true;
+				break;
+			case HPWMI_OMEN_KEY: case HPWMI_SMART_ADAPTER: case HPWMI_CPU_BATTERY_THROTTLE:
+			case HPWMI_COOLSENSE_SYSTEM_MOBILE: case HPWMI_COOLSENSE_SYSTEM_HOT:
+				/* The firmware may switch the thermal profile on these */
+				profile = true;
+				hp_wmi_handle_event(ev[i].id, ev[i].data);
+				break;
+			default:
+				hp_wmi_handle_event(ev[i].id, ev[i].data);
+				break;
+			}
+		}
+		if (dock) {
+			hp_wmi_cache_invalidate(HPWMI_HARDWARE_QUERY);
+			hp_wmi_dock_refresh();
+			hp_wmi_dock_attrs_changed();
+		}
+		if (wireless) {
+			hp_wmi_cache_invalidate(HPWMI_WIRELESS_QUERY);
+			hp_wmi_rfkill_refresh();
+		}
+		if (backlight)
+			fourzone_backlight_changed();
+		if (profile)
+			hp_wmi_profile_kick();
+	} while (n == ARRAY_SIZE(ev));
+}
+
+/*
+ * /dev/hp-wmi-events: raw event stream for userspace. Every open gets its own
+ * ring and filter; records are pushed straight from the notify callback so
+ * readers see events before the pipeline above has processed them.
+ */
+#define HPWMI_EVDEV_RING_SIZE 256
+struct hp_wmi_evdev_client {
+	struct list_head node;
+	DECLARE_KFIFO(ring, struct hp_wmi_event_record, HPWMI_EVDEV_RING_SIZE);
+	wait_queue_head_t wait;
+	struct mutex read_lock;
+	u64 filter;
+	u64 delivered;
+	u64 overflows;
+};
+static LIST_HEAD(hp_wmi_evdev_clients);
+static DEFINE_SPINLOCK(hp_wmi_evdev_lock);
+static bool hp_wmi_evdev_registered;
+
+static void hp_wmi_evdev_push(const struct hp_wmi_event *ev)
+{
+	struct hp_wmi_event_record rec = { .id = ev->id, .data = ev->data, .timestamp_ns = ktime_to_ns(ev->stamp) };
+	struct hp_wmi_evdev_client *c;
+
+	guard(spinlock_irqsave)(&hp_wmi_evdev_lock);
+	list_for_each_entry(c, &hp_wmi_evdev_clients, node) {
+		if (!(READ_ONCE(c->filter) & HP_WMI_EVENT_FILTER_BIT(rec.id)))
+			continue;
+		if (!kfifo_put(&c->ring, rec)) {
+			c->overflows++;
+			continue;
+		}
+		c->delivered++;
+		wake_up_interruptible_poll(&c->wait, EPOLLIN | EPOLLRDNORM);
+	}
+}
+
+static int hp_wmi_evdev_open(struct inode *inode, struct file *file)
+{
+	struct hp_wmi_evdev_client *c = kzalloc(sizeof(*c), GFP_KERNEL);
+
+	if (!c)
+		return -ENOMEM;
+	INIT_KFIFO(c->ring);
+	init_waitqueue_head(&c->wait);
+	mutex_init(&c->read_lock);
+	c->filter = U64_MAX;
+	scoped_guard(spinlock_irqsave, &hp_wmi_evdev_lock)
+		list_add_tail(&c->node, &hp_wmi_evdev_clients);
+	file->private_data = c;
+	return stream_open(inode, file);
+}
+
+static int hp_wmi_evdev_release(struct inode *inode, struct file *file)
+{
+	struct hp_wmi_evdev_client *c = file->private_data;
+
+	scoped_guard(spinlock_irqsave, &hp_wmi_evdev_lock)
+		list_del(&c->node);
+	kfree(c);
+	return 0;
+}
+
+static ssize_t hp_wmi_evdev_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct hp_wmi_evdev_client *c = file->private_data;
+	unsigned int copied;
+	int r;
+
+	if (count < sizeof(struct hp_wmi_event_record))
+		return -EINVAL;
+	count = rounddown(count, sizeof(struct hp_wmi_event_record));
+
+	for (;;) {
+		if (kfifo_is_empty(&c->ring)) {
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			r = wait_event_interruptible(c->wait, !kfifo_is_empty(&c->ring));
+			if (r)
+				return r;
+		}
+		if (mutex_lock_interruptible(&c->read_lock))
+			return -ERESTARTSYS;
+		r = kfifo_to_user(&c->ring, buf, count, &copied);
+		mutex_unlock(&c->read_lock);
+		if (r)
+			return r;
+		/* Another reader may have drained the ring first, wait again */
+		if (copied)
+			return copied;
+	}
+}
+
+static __poll_t hp_wmi_evdev_poll(struct file *file, poll_table *wait)
+{
+	struct hp_wmi_evdev_client *c = file->private_data;
+
+	poll_wait(file, &c->wait, wait);
+	return kfifo_is_empty(&c->ring) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static long hp_wmi_evdev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct hp_wmi_evdev_client *c = file->private_data;
+	void __user *argp = (void __user *)arg;
+	struct hp_wmi_event_stats st = {};
+	u64 filter;
+
+	switch (cmd) {
+	case HP_WMI_IOC_EVT_GET_STATS:
+		scoped_guard(spinlock_irqsave, &hp_wmi_evdev_lock) {
+			st.delivered = c->delivered;
+			st.overflows = c->overflows;
+		}
+		st.queued = kfifo_len(&c->ring);
+		st.capacity = kfifo_size(&c->ring);
+		return copy_to_user(argp, &st, sizeof(st)) ? -EFAULT : 0;
+	case HP_WMI_IOC_EVT_SET_FILTER:
+		if (copy_from_user(&filter, argp, sizeof(filter)))
+			return -EFAULT;
+		WRITE_ONCE(c->filter, filter);
+		return 0;
+	case HP_WMI_IOC_EVT_GET_FILTER:
+		filter = READ_ONCE(c->filter);
+		return copy_to_user(argp, &filter, sizeof(filter)) ? -EFAULT : 0;
+	}
+	return -ENOTTY;
+}
+
+static const struct file_operations hp_wmi_evdev_fops = {
+	.owner = THIS_MODULE,
+	.open = hp_wmi_evdev_open,
+	.release = hp_wmi_evdev_release,
+	.read = hp_wmi_evdev_read,
+	.poll = hp_wmi_evdev_poll,
+	.unlocked_ioctl = hp_wmi_evdev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice hp_wmi_evdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "hp-wmi-events",
+	.fops = &hp_wmi_evdev_fops,
+	.mode = 0440,
+};
+
+static void hp_wmi_evdev_init(void)
+{
+	int err = misc_register(&hp_wmi_evdev);
+
+	if (err)
+		pr_warn("Fail register event device:%d\n", err);
+	hp_wmi_evdev_registered = !err;
+}
+
+static void hp_wmi_evdev_exit(void)
+{
+	if (hp_wmi_evdev_registered)
+		misc_deregister(&hp_wmi_evdev);
+	hp_wmi_evdev_registered = false;
+}
+
+static void hp_wmi_notify(union acpi_object *obj, void *context) {
+	struct hp_wmi_event ev = { .stamp = ktime_get() };
+	u32 *loc;
+	bool queued;
+
+	if (!obj || obj->type != ACPI_TYPE_BUFFER) { pr_info("Unk WMI evt type %d\n", obj ? obj->type : -1); return; }
+	loc = (u32 *)obj->buffer.pointer;
+	if (obj->buffer.length == 8) { ev.id = loc[0]; ev.data = loc[1]; }
+	else if (obj->buffer.length == 16) { ev.id = loc[0]; ev.data = loc[2]; }
+	else { pr_info("Unk WMI evt len %d\n", obj->buffer.length); return; }
+
+	hp_wmi_evdev_push(&ev);
+	scoped_guard(spinlock_irqsave, &hp_wmi_event_lock)
+		queued = kfifo_put(&hp_wmi_event_ring, ev);
+	if (!queued)
+		pr_warn_ratelimited("WMI event ring full, dropped evt_id:0x%x\n", ev.id);
+	queue_work(system_wq, &hp_wmi_event_work);
+}
+static int hp_wmi_input_setup(void) {
+	struct input_dev *dev; acpi_status status; int err, val, tablet_mode;
+	dev = input_allocate_device(); if (!dev) return -ENOMEM;
+	dev->name = "HP WMI hotkeys"; dev->phys = "wmi/input0"; dev->id.bustype = BUS_HOST;
+	err = sparse_keymap_setup(dev, hp_wmi_keymap, NULL); if (err) goto err_free_dev;
+	__set_bit(EV_SW, dev->evbit);
+	val = hp_wmi_get_dock_state(); if (val >= 0) { __set_bit(SW_DOCK, dev->swbit); input_report_switch(dev, SW_DOCK, val); } else pr_warn("Fail init dock state:%d\n", val);
+	if (enable_tablet_mode_sw != 0) { tablet_mode = hp_wmi_get_tablet_mode(); if (tablet_mode >= 0) { __set_bit(SW_TABLET_MODE, dev->swbit); input_report_switch(dev, SW_TABLET_MODE, tablet_mode); } else if (enable_tablet_mode_sw == 1) pr_warn("Fail init tablet SW_TABLET_MODE:%d\n", tablet_mode); }
+	input_sync(dev);
+	if (!hp_wmi_bios_2009_later() && hp_wmi_bios_2008_later()) { err = hp_wmi_enable_hotkeys(); if (err) pr_warn("Fail enable hotkeys:%d\n", err); }
+	status = emulate ? AE_OK : wmi_install_notify_handler(HPWMI_EVENT_GUID, hp_wmi_notify, NULL); if (ACPI_FAILURE(status)) { pr_err("Fail WMI notify handler:0x%x\n", status); err = -EIO; goto err_free_keymap_and_dev; } // Zmieniona etykieta
+	err = input_register_device(dev); if (err) goto err_uninstall_notifier;
+	/* Only a registered device is visible to the event worker and probe */
+	hp_wmi_input_dev = dev;
+	return 0; // Sukces
+err_uninstall_notifier: if (!emulate) wmi_remove_notify_handler(HPWMI_EVENT_GUID); cancel_work_sync(&hp_wmi_event_work);
+err_free_keymap_and_dev: // Etykieta dla czyszczenia mapy klawiszy (jeśli sparse_keymap_setup się powiodło) i urządzenia
+	// sparse_keymap_free(dev); // Usuwamy, bo nie istnieje
+err_free_dev: input_free_device(dev); return err;
+}
+static void hp_wmi_input_destroy(void) {
+	if (hp_wmi_input_dev) { if (!emulate) wmi_remove_notify_handler(HPWMI_EVENT_GUID); cancel_work_sync(&hp_wmi_event_work); input_unregister_device(hp_wmi_input_dev); hp_wmi_input_dev = NULL; }
+}
+static int hp_wmi_rfkill_setup(struct platform_device *device) {
+	int err = 0, wireless = hp_wmi_read_int(HPWMI_WIRELESS_QUERY); if (wireless < 0) { pr_warn("Fail read wireless query rfkill:%d\n", wireless); return wireless; }
+	if (wireless & 1) { wifi_rfkill = rfkill_alloc("hp-wifi", &device->dev, RFKILL_TYPE_WLAN, &hp_wmi_rfkill_ops, (void *)(uintptr_t)HPWMI_WIFI); if (!wifi_rfkill) { err = -ENOMEM; goto err_cleanup; } rfkill_set_states(wifi_rfkill, hp_wmi_get_sw_state(HPWMI_WIFI), hp_wmi_get_hw_state(HPWMI_WIFI)); err = rfkill_register(wifi_rfkill); if (err) goto err_cleanup; }
+	if (wireless & 2) { bluetooth_rfkill = rfkill_alloc("hp-bluetooth", &device->dev, RFKILL_TYPE_BLUETOOTH, &hp_wmi_rfkill_ops, (void *)(uintptr_t)HPWMI_BLUETOOTH); if (!bluetooth_rfkill) { err = -ENOMEM; goto err_cleanup; } rfkill_set_states(bluetooth_rfkill, hp_wmi_get_sw_state(HPWMI_BLUETOOTH), hp_wmi_get_hw_state(HPWMI_BLUETOOTH)); err = rfkill_register(bluetooth_rfkill); if (err) goto err_cleanup; }
+	if (wireless & 4) { wwan_rfkill = rfkill_alloc("hp-wwan", &device->dev, RFKILL_TYPE_WWAN, &hp_wmi_rfkill_ops, (void *)(uintptr_t)HPWMI_WWAN); if (!wwan_rfkill) { err = -ENOMEM; goto err_cleanup; } rfkill_set_states(wwan_rfkill, hp_wmi_get_sw_state(HPWMI_WWAN), hp_wmi_get_hw_state(HPWMI_WWAN)); err = rfkill_register(wwan_rfkill); if (err) goto err_cleanup; }
+	return 0;
+err_cleanup: if (wwan_rfkill) { rfkill_unregister(wwan_rfkill); rfkill_destroy(wwan_rfkill); wwan_rfkill = NULL; } if (bluetooth_rfkill) { rfkill_unregister(bluetooth_rfkill); rfkill_destroy(bluetooth_rfkill); bluetooth_rfkill = NULL; } if (wifi_rfkill) { rfkill_unregister(wifi_rfkill); rfkill_destroy(wifi_rfkill); wifi_rfkill = NULL; } return err;
+}
+static int hp_wmi_rfkill2_setup(struct platform_device *device) {
+	struct bios_rfkill2_state s = {0}; int err = 0, i; err = hp_wmi_perform_query(HPWMI_WIRELESS2_QUERY, HPWMI_READ, &s, sizeof(s), sizeof(s)); if (err) return err < 0 ? err : -EINVAL;
+	if (s.count > HPWMI_MAX_RFKILL2_DEVICES) { pr_warn("rfkill2 count %d > max %d\n", s.count, HPWMI_MAX_RFKILL2_DEVICES); return -EINVAL; }
+	for (i = 0; i < s.count; i++) { struct rfkill *rd; enum rfkill_type t; const char *n;
+		switch (s.device[i].radio_type) { case HPWMI_WIFI:t = RFKILL_TYPE_WLAN; n = "hp-wifi2"; break; case HPWMI_BLUETOOTH:t = RFKILL_TYPE_BLUETOOTH; n = "hp-bluetooth2"; break; case HPWMI_WWAN:t = RFKILL_TYPE_WWAN; n = "hp-wwan2"; break; case HPWMI_GPS:t = RFKILL_TYPE_GPS; n = "hp-gps2"; break; default:pr_warn("unk rfkill2 type 0x%x\n", s.device[i].radio_type); continue; }
+		if (!s.device[i].vendor_id && !s.device[i].product_id) { pr_warn("rfkill2 dev %d zero vid/pid (type 0x%x)\n", i, s.device[i].radio_type); continue; }
+		rd = rfkill_alloc(n, &device->dev, t, &hp_wmi_rfkill2_ops, (void *)(uintptr_t)i); if (!rd) { err = -ENOMEM; goto fail; }
+		rfkill2[rfkill2_count].id = s.device[i].rfkill_id; rfkill2[rfkill2_count].num = i; rfkill2[rfkill2_count].rfkill = rd;
+		rfkill_set_states(rd, IS_SWBLOCKED(s.device[i].power), IS_HWBLOCKED(s.device[i].power));
+		if (!(s.device[i].power & HPWMI_POWER_BIOS)) pr_info("rfkill2 dev %s (type 0x%x) blocked by BIOS\n", n, s.device[i].radio_type);
+		err = rfkill_register(rd); if (err) { rfkill_destroy(rd); rfkill2[rfkill2_count].rfkill = NULL; goto fail; } rfkill2_count++;
+	} return 0;
+fail: while (--rfkill2_count >= 0) { if (rfkill2[rfkill2_count].rfkill) { rfkill_unregister(rfkill2[rfkill2_count].rfkill); rfkill_destroy(rfkill2[rfkill2_count].rfkill); rfkill2[rfkill2_count].rfkill = NULL; } } rfkill2_count = 0; return err;
+}
+static int platform_profile_omen_get(struct device *d, enum platform_profile_option *p) { int t = omen_thermal_profile_get(); if (t < 0)return t; switch (t) { case HP_OMEN_THERMAL_PROFILE_PERFORMANCE:*p = PLATFORM_PROFILE_PERFORMANCE; break; case HP_OMEN_THERMAL_PROFILE_DEFAULT:*p = PLATFORM_PROFILE_BALANCED; break; case HP_OMEN_THERMAL_PROFILE_COOL:*p = PLATFORM_PROFILE_COOL; break; default:pr_warn("Unk Omen EC profile:%d\n", t); return -EINVAL; } return 0; }
+static int platform_profile_omen_set(struct device *d, enum platform_profile_option p) { int t, r; hp_gov_manual_override(); guard(rwsem_read)(&hp_wmi_ctl_rwsem); switch (p) { case PLATFORM_PROFILE_PERFORMANCE:t = HP_OMEN_THERMAL_PROFILE_PERFORMANCE; break; case PLATFORM_PROFILE_BALANCED:t = HP_OMEN_THERMAL_PROFILE_DEFAULT; break; case PLATFORM_PROFILE_COOL:t = HP_OMEN_THERMAL_PROFILE_COOL; break; default:return -EINVAL; } r = omen_thermal_profile_set(t); if (!r)hp_wmi_profile_written(t); return r; }
+static int generic_thermal_profile_get_wmi(void) { return hp_wmi_read_int(HPWMI_THERMAL_PROFILE_QUERY); }
+static int generic_thermal_profile_set_wmi(int tp) { if (tp < 0 || tp > 2)return -EINVAL; return hp_wmi_perform_query(HPWMI_THERMAL_PROFILE_QUERY, HPWMI_WRITE, &tp, sizeof(tp), 0); }
+static int hp_wmi_platform_profile_get(struct device *d, enum platform_profile_option *p) { int t = generic_thermal_profile_get_wmi(); if (t < 0)return t; switch (t) { case HP_THERMAL_PROFILE_PERFORMANCE:*p = PLATFORM_PROFILE_PERFORMANCE; break; case HP_THERMAL_PROFILE_DEFAULT:*p = PLATFORM_PROFILE_BALANCED; break; case HP_THERMAL_PROFILE_COOL:*p = PLATFORM_PROFILE_COOL; break; default:pr_warn("Unk generic WMI profile:%d\n", t); return -EINVAL; } return 0; }
+static int hp_wmi_platform_profile_set(struct device *d, enum platform_profile_option p) { int t, r; hp_gov_manual_override(); guard(rwsem_read)(&hp_wmi_ctl_rwsem); switch (p) { case PLATFORM_PROFILE_PERFORMANCE:t = HP_THERMAL_PROFILE_PERFORMANCE; break; case PLATFORM_PROFILE_BALANCED:t = HP_THERMAL_PROFILE_DEFAULT; break; case PLATFORM_PROFILE_COOL:t = HP_THERMAL_PROFILE_COOL; break; default:return -EINVAL; } r = generic_thermal_profile_set_wmi(t); if (!r)hp_wmi_profile_written(t); return r; }
+
+/*
+ * The profile can change behind our back (Omen key, power source switch), so
+ * the driver watches for it: profile-related WMI events trigger a check, and a
+ * watcher re-reads the EC byte at a rate that backs off from profile_poll_min_ms
+ * to profile_poll_max_ms while nothing changes. The same watcher samples
+ * hddtemp at the slow rate so its sysfs file can be polled.
+ */
+static unsigned int profile_poll_min_ms = 250;
+module_param(profile_poll_min_ms, uint, 0644);
+MODULE_PARM_DESC(profile_poll_min_ms, "Fastest thermal profile watcher period after a change (ms)");
+static unsigned int profile_poll_max_ms = 8000;
+module_param(profile_poll_max_ms, uint, 0644);
+MODULE_PARM_DESC(profile_poll_max_ms, "Slowest thermal profile watcher period (ms, 0 = events only)");
+static int hp_wmi_profile_last = -1;
+static int hp_wmi_profile_suspend = -1;
+static unsigned int hp_wmi_profile_period_ms;
+static DEFINE_MUTEX(hp_wmi_watch_lock);
+static struct { int dock, tablet, hddtemp; bool hddtemp_ok; } hp_wmi_attr_last = { INT_MIN, INT_MIN, INT_MIN, true };
+static void hp_wmi_watch_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hp_wmi_watch_work, hp_wmi_watch_work_fn);
+
+static int hp_wmi_profile_raw(void)
+{
+	return is_omen_thermal_profile() ? omen_thermal_profile_get() : generic_thermal_profile_get_wmi();
+}
+
+/*
+ * Called with hp_wmi_watch_lock held; returns true if the profile changed and
+ * listeners need to be told. The caller notifies after dropping the lock, as
+ * platform_profile_notify() takes the lock our profile_set callbacks run under.
+ */
+static bool hp_wmi_profile_check(void)
+{
+	int tp = hp_wmi_profile_raw(), last = hp_wmi_profile_last;
+
+	if (tp < 0 || tp == last)
+		return false;
+	hp_wmi_profile_last = tp;
+	return last >= 0;
+}
+
+static void hp_wmi_attr_update(const char *name, int *last, int val)
+{
+	if (val < 0 || val == *last)
+		return;
+	if (*last != INT_MIN)
+		sysfs_notify(&hp_wmi_platform_dev->dev.kobj, NULL, name);
+	*last = val;
+}
+
+/* HPWMI_DOCK_EVENT: both attributes come from the (cached) hardware query */
+static void hp_wmi_dock_attrs_changed(void)
+{
+	if (!hp_wmi_platform_dev)
+		return;
+	guard(mutex)(&hp_wmi_watch_lock);
+	hp_wmi_attr_update("dock", &hp_wmi_attr_last.dock, hp_wmi_hw_state(HPWMI_DOCK_MASK));
+	hp_wmi_attr_update("tablet", &hp_wmi_attr_last.tablet, hp_wmi_hw_state(HPWMI_TABLET_MASK));
+}
+
+static void hp_wmi_watch_work_fn(struct work_struct *work)
+{
+	unsigned int max_ms = READ_ONCE(profile_poll_max_ms), period;
+	bool changed;
+	int temp, tp;
+
+	scoped_guard(mutex, &hp_wmi_watch_lock) {
+		changed = hp_wmi_profile_check();
+		tp = hp_wmi_profile_last;
+		if (changed)
+			hp_wmi_profile_period_ms = READ_ONCE(profile_poll_min_ms);
+		else
+			hp_wmi_profile_period_ms = min(hp_wmi_profile_period_ms * 2, max_ms);
+
+		if (hp_wmi_profile_period_ms >= max_ms && hp_wmi_attr_last.hddtemp_ok) {
+			temp = hp_wmi_read_int(HPWMI_HDDTEMP_QUERY);
+			/* Not every BIOS has a drive sensor, stop asking after the first failure */
+			hp_wmi_attr_last.hddtemp_ok = temp >= 0;
+			hp_wmi_attr_update("hddtemp", &hp_wmi_attr_last.hddtemp, temp);
+		}
+		period = hp_wmi_profile_period_ms;
+	}
+	if (changed) {
+		hp_wmi_power_profile_changed(tp);
+		platform_profile_notify(platform_profile_dev);
+	}
+	if (max_ms)
+		queue_delayed_work(system_freezable_wq, &hp_wmi_watch_work, msecs_to_jiffies(max(period, 1U)));
+}
+
+/* Something that may have switched the profile happened: look now and watch closely for a while. */
+static void hp_wmi_profile_kick(void)
+{
+	guard(mutex)(&hp_wmi_watch_lock);
+	if (!platform_profile_support)
+		return;
+	hp_wmi_profile_period_ms = READ_ONCE(profile_poll_min_ms) / 2;
+	mod_delayed_work(system_freezable_wq, &hp_wmi_watch_work, 0);
+}
+
+/*
+ * Our own writes are reported by the platform_profile core, keep the watcher
+ * quiet about them.
+ */
+static void hp_wmi_profile_written(int tp)
+{
+	scoped_guard(mutex, &hp_wmi_watch_lock)
+		hp_wmi_profile_last = tp;
+	hp_wmi_power_profile_changed(tp);
+}
+
+/*
+ * The profile in effect at suspend, however it got there (us, the Omen key
+ * or the firmware), is what resume puts back.
+ */
+static void hp_wmi_profile_save(void)
+{
+	guard(mutex)(&hp_wmi_watch_lock);
+	hp_wmi_profile_suspend = hp_wmi_profile_last;
+}
+
+/* Returns true if the profile had to be rewritten */
+static bool hp_wmi_profile_restore(void)
+{
+	int tp, r;
+
+	guard(mutex)(&hp_wmi_watch_lock);
+	if (hp_wmi_profile_suspend < 0)
+		return false;
+	tp = hp_wmi_profile_raw();
+	if (tp < 0 || tp == hp_wmi_profile_suspend)
+		return false;
+	r = is_omen_thermal_profile() ? omen_thermal_profile_set(hp_wmi_profile_suspend) : generic_thermal_profile_set_wmi(hp_wmi_profile_suspend);
+	if (r) {
+		pr_warn("Fail restore thermal profile:%d\n", r);
+		return false;
+	}
+	hp_wmi_profile_last = hp_wmi_profile_suspend;
+	return true;
+}
+
+static void hp_wmi_watch_start(int tp)
+{
+	scoped_guard(mutex, &hp_wmi_watch_lock) {
+		hp_wmi_profile_last = tp;
+		hp_wmi_profile_period_ms = READ_ONCE(profile_poll_max_ms);
+	}
+	if (hp_wmi_profile_period_ms)
+		queue_delayed_work(system_freezable_wq, &hp_wmi_watch_work, msecs_to_jiffies(hp_wmi_profile_period_ms));
+}
+
+/* The event worker runs until module exit, keep it from kicking the watcher back on */
+static void hp_wmi_watch_stop(void)
+{
+	scoped_guard(mutex, &hp_wmi_watch_lock)
+		platform_profile_support = false;
+	flush_work(&hp_wmi_event_work);
+	cancel_delayed_work_sync(&hp_wmi_watch_work);
+}
+
+/*
+ * GPU power modes (HPWMI_GM). Each thermal profile can carry a set of them
+ * that is applied right after the profile switches, whoever switched it:
+ * platform_profile, the governor or the Omen key. The CPU limits have no
+ * confirmed source for their BIOS defaults and maxima, so none are offered.
+ */
+enum hp_power_slot { HP_POWER_COOL, HP_POWER_BALANCED, HP_POWER_PERFORMANCE, HP_POWER_SLOTS };
+static const char * const hp_power_slot_names[HP_POWER_SLOTS] = { "cool", "balanced", "performance" };
+static const char * const hp_gpu_mode_names[] = { [HP_GPU_MODE_HYBRID] = "hybrid", [HP_GPU_MODE_DISCRETE] = "discrete" };
+struct hp_power_set { bool valid; u8 ctgp_enable, ppab_enable; };
+static struct {
+	struct hp_wmi_gpu_modes gpu;
+	struct hp_power_set set[HP_POWER_SLOTS];
+	bool user;	/* written since boot, resume puts it back */
+} hp_power;
+static DEFINE_MUTEX(hp_power_lock);
+static bool hp_power_registered;
+
+static void hp_wmi_power_probe(void)
+{
+	if (!hp_wmi_board_may(HPWMI_BOARD_GM))
+		return;
+	guard(mutex)(&hp_power_lock);
+	if (!hp_wmi_perform_query(HPWMI_GPU_MODES_GET_QUERY, HPWMI_GM, &hp_power.gpu, sizeof(hp_power.gpu), sizeof(hp_power.gpu)))
+		set_bit(HPWMI_CAP_GPU, hp_wmi_caps);
+	if (hp_wmi_read_int(HPWMI_GPU_MODE_QUERY) >= 0)
+		set_bit(HPWMI_CAP_GPU_MODE, hp_wmi_caps);
+}
+
+/* Called with hp_power_lock held */
+static int hp_power_gpu_write(const struct hp_wmi_gpu_modes *g)
+{
+	struct hp_wmi_gpu_modes b = *g;
+	int r = hp_wmi_perform_query(HPWMI_GPU_MODES_SET_QUERY, HPWMI_GM, &b, sizeof(b), 0);
+
+	if (r)
+		return r < 0 ? r : -EINVAL;
+	hp_power.gpu = *g;
+	return 0;
+}
+
+static int hp_wmi_power_slot(int tp)
+{
+	if (is_omen_thermal_profile()) {
+		switch (tp) {
+		case HP_OMEN_THERMAL_PROFILE_COOL: return HP_POWER_COOL;
+		case HP_OMEN_THERMAL_PROFILE_DEFAULT: return HP_POWER_BALANCED;
+		case HP_OMEN_THERMAL_PROFILE_PERFORMANCE: return HP_POWER_PERFORMANCE;
+		}
+	} else {
+		switch (tp) {
+		case HP_THERMAL_PROFILE_COOL: return HP_POWER_COOL;
+		case HP_THERMAL_PROFILE_DEFAULT: return HP_POWER_BALANCED;
+		case HP_THERMAL_PROFILE_PERFORMANCE: return HP_POWER_PERFORMANCE;
+		}
+	}
+	return -EINVAL;
+}
+
+/* The profile is now tp (raw firmware value): bring its limit set along */
+static void hp_wmi_power_profile_changed(int tp)
+{
+	int slot = hp_wmi_power_slot(tp), r;
+	struct hp_wmi_gpu_modes g;
+	struct hp_power_set *s;
+
+	if (slot < 0)
+		return;
+	guard(mutex)(&hp_power_lock);
+	s = &hp_power.set[slot];
+	if (!s->valid || !test_bit(HPWMI_CAP_GPU, hp_wmi_caps))
+		return;
+	g = hp_power.gpu;
+	g.ctgp_enable = s->ctgp_enable;
+	g.ppab_enable = s->ppab_enable;
+	r = hp_power_gpu_write(&g);
+	if (r)
+		pr_warn("Fail apply %s power limits:%d\n", hp_power_slot_names[slot], r);
+	else
+		hp_power.user = true;
+}
+
+static void hp_wmi_power_restore(void)
+{
+	int r;
+
+	guard(mutex)(&hp_power_lock);
+	if (!hp_power.user || !test_bit(HPWMI_CAP_GPU, hp_wmi_caps))
+		return;
+	r = hp_power_gpu_write(&hp_power.gpu);
+	if (r)
+		pr_warn("Fail restore power limits:%d\n", r);
+}
+
+static ssize_t hp_power_gpu_store(size_t off, u8 min, u8 max, const char *buf, size_t count)
+{
+	struct hp_wmi_gpu_modes g;
+	u8 v;
+	int r = kstrtou8(buf, 10, &v);
+
+	if (r)
+		return r;
+	if (v < min || v > max)
+		return -EINVAL;
+	guard(mutex)(&hp_power_lock);
+	g = hp_power.gpu;
+	((u8 *)&g)[off] = v;
+	r = hp_power_gpu_write(&g);
+	if (r)
+		return r;
+	hp_power.user = true;
+	return count;
+}
+
+#define HP_POWER_GPU_ATTR(_name, _field, _min, _max)							\
+static ssize_t _name##_show(struct device *d, struct device_attribute *a, char *b) { guard(mutex)(&hp_power_lock); return sysfs_emit(b, "%u\n", hp_power.gpu._field); } \
+static ssize_t _name##_store(struct device *d, struct device_attribute *a, const char *buf, size_t count) { return hp_power_gpu_store(offsetof(struct hp_wmi_gpu_modes, _field), _min, _max, buf, count); } \
+static DEVICE_ATTR_RW(_name)
+HP_POWER_GPU_ATTR(gpu_ctgp_enable, ctgp_enable, 0, 1);
+HP_POWER_GPU_ATTR(gpu_ppab_enable, ppab_enable, 0, 1);
+HP_POWER_GPU_ATTR(gpu_dstate, dstate, 1, 4);
+static ssize_t gpu_slowdown_temp_show(struct device *d, struct device_attribute *a, char *b) { guard(mutex)(&hp_power_lock); return sysfs_emit(b, "%u\n", hp_power.gpu.slowdown_temp); }
+static DEVICE_ATTR_RO(gpu_slowdown_temp);
+
+/* The BIOS switches the GPU mux on the next boot */
+static ssize_t gpu_mode_show(struct device *d, struct device_attribute *a, char *b)
+{
+	int v = hp_wmi_read_int(HPWMI_GPU_MODE_QUERY);
+
+	if (v < 0)
+		return v;
+	if (v >= ARRAY_SIZE(hp_gpu_mode_names))
+		return sysfs_emit(b, "unknown (%d)\n", v);
+	return sysfs_emit(b, "%s\n", hp_gpu_mode_names[v]);
+}
+static ssize_t gpu_mode_store(struct device *d, struct device_attribute *a, const char *buf, size_t count)
+{
+	int v = sysfs_match_string(hp_gpu_mode_names, buf), r;
+
+	if (v < 0)
+		return v;
+	r = hp_wmi_perform_query(HPWMI_GPU_MODE_QUERY, HPWMI_WRITE, &v, sizeof(v), 0);
+	return r ? (r < 0 ? r : -EINVAL) : count;
+}
+static DEVICE_ATTR_RW(gpu_mode);
+
+static ssize_t profile_limits_show(struct device *d, struct device_attribute *a, char *b)
+{
+	struct hp_power_set *s;
+	int i, len = 0;
+
+	guard(mutex)(&hp_power_lock);
+	for (i = 0; i < HP_POWER_SLOTS; i++) {
+		s = &hp_power.set[i];
+		if (s->valid)
+			len += sysfs_emit_at(b, len, "%s %u %u\n", hp_power_slot_names[i],
+					     s->ctgp_enable, s->ppab_enable);
+		else
+			len += sysfs_emit_at(b, len, "%s -\n", hp_power_slot_names[i]);
+	}
+	return len;
+}
+
+/* "<profile> <ctgp> <ppab>", or "<profile> -" to clear */
+static ssize_t profile_limits_store(struct device *d, struct device_attribute *a, const char *buf, size_t count)
+{
+	struct hp_power_set set = { .valid = true };
+	char name[16], dash[3];
+	int slot, tp;
+
+	if (sscanf(buf, "%15s %2s", name, dash) == 2 && !strcmp(dash, "-"))
+		set.valid = false;
+	else if (sscanf(buf, "%15s %hhu %hhu", name, &set.ctgp_enable, &set.ppab_enable) != 3)
+		return -EINVAL;
+	slot = match_string(hp_power_slot_names, HP_POWER_SLOTS, name);
+	if (slot < 0)
+		return slot;
+	if (set.valid && (set.ctgp_enable > 1 || set.ppab_enable > 1))
+		return -EINVAL;
+	scoped_guard(mutex, &hp_power_lock)
+		hp_power.set[slot] = set;
+	/* A set for the active profile takes effect now */
+	scoped_guard(mutex, &hp_wmi_watch_lock)
+		tp = hp_wmi_profile_last;
+	if (set.valid && hp_wmi_power_slot(tp) == slot)
+		hp_wmi_power_profile_changed(tp);
+	return count;
+}
+static DEVICE_ATTR_RW(profile_limits);
+
+static struct attribute *hp_power_attrs[] = {
+	&dev_attr_gpu_ctgp_enable.attr, &dev_attr_gpu_ppab_enable.attr, &dev_attr_gpu_dstate.attr, &dev_attr_gpu_slowdown_temp.attr,
+	&dev_attr_gpu_mode.attr, &dev_attr_profile_limits.attr,
+	NULL
+};
+
+static umode_t hp_power_attr_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	if (attr == &dev_attr_gpu_mode.attr)
+		return test_bit(HPWMI_CAP_GPU_MODE, hp_wmi_caps) ? attr->mode : 0;
+	return test_bit(HPWMI_CAP_GPU, hp_wmi_caps) ? attr->mode : 0;
+}
+static const struct attribute_group hp_power_group = { .name = "power_limits", .attrs = hp_power_attrs, .is_visible = hp_power_attr_visible };
+
+static void hp_wmi_power_setup(struct platform_device *pdev)
+{
+	if (!test_bit(HPWMI_CAP_GPU, hp_wmi_caps) && !test_bit(HPWMI_CAP_GPU_MODE, hp_wmi_caps))
+		return;
+	hp_power_registered = !sysfs_create_group(&pdev->dev.kobj, &hp_power_group);
+	if (!hp_power_registered)
+		pr_warn("Fail create power_limits group\n");
+}
+
+/*
+ * Automatic profile governor (opt-in through auto_profile/enable). Every
+ * period it samples the average CPU utilisation and the package temperature
+ * and moves between cool, balanced and performance. The thresholds are
+ * widened by the hysteresis in the direction of the current profile and a
+ * profile is held for at least min_dwell_ms, except that a hot package always
+ * drops out of performance at once. A manual platform_profile write turns the
+ * governor off.
+ */
+enum hp_gov_state { HP_GOV_COOL, HP_GOV_BALANCED, HP_GOV_PERFORMANCE, HP_GOV_STATES };
+static const char * const hp_gov_state_names[HP_GOV_STATES] = { "cool", "balanced", "performance" };
+static const int hp_gov_omen_tp[HP_GOV_STATES] = { HP_OMEN_THERMAL_PROFILE_COOL, HP_OMEN_THERMAL_PROFILE_DEFAULT, HP_OMEN_THERMAL_PROFILE_PERFORMANCE };
+static const int hp_gov_generic_tp[HP_GOV_STATES] = { HP_THERMAL_PROFILE_COOL, HP_THERMAL_PROFILE_DEFAULT, HP_THERMAL_PROFILE_PERFORMANCE };
+static struct {
+	bool enabled;
+	unsigned int period_ms, min_dwell_ms;
+	unsigned int busy_util, idle_util, util_hyst;	/* percent */
+	unsigned int hot_temp, temp_hyst;		/* degree Celsius */
+	char zone[THERMAL_NAME_LENGTH];
+	enum hp_gov_state state;
+	ktime_t since;
+	u64 time_ms[HP_GOV_STATES];
+	unsigned int transitions;
+	u64 idle_us, wall_us;
+	bool hot;
+} hp_gov = {
+	.period_ms = 1000, .min_dwell_ms = 10000,
+	.busy_util = 60, .idle_util = 15, .util_hyst = 10,
+	.hot_temp = 90, .temp_hyst = 5,
+	.zone = "x86_pkg_temp",
+};
+static DEFINE_MUTEX(hp_gov_lock);
+static void hp_gov_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hp_gov_work, hp_gov_work_fn);
+
+static int hp_gov_state_get(void)
+{
+	const int *map = is_omen_thermal_profile() ? hp_gov_omen_tp : hp_gov_generic_tp;
+	int tp = hp_wmi_profile_raw(), i;
+
+	if (tp < 0)
+		return tp;
+	for (i = 0; i < HP_GOV_STATES; i++)
+		if (map[i] == tp)
+			return i;
+	return -EINVAL;
+}
+
+/* Charge the time since the last switch to the current state. Called with hp_gov_lock held. */
+static void hp_gov_account(void)
+{
+	ktime_t now = ktime_get();
+
+	hp_gov.time_ms[hp_gov.state] += ktime_ms_delta(now, hp_gov.since);
+	hp_gov.since = now;
+}
+
+static int hp_gov_switch(enum hp_gov_state st)
+{
+	int tp, r;
+
+	guard(rwsem_read)(&hp_wmi_ctl_rwsem);
+	if (is_omen_thermal_profile()) {
+		tp = hp_gov_omen_tp[st];
+		r = omen_thermal_profile_set(tp);
+	} else {
+		tp = hp_gov_generic_tp[st];
+		r = generic_thermal_profile_set_wmi(tp);
+		if (r > 0)
+			r = -EIO;
+	}
+	if (r)
+		return r;
+	hp_wmi_profile_written(tp);
+	hp_gov_account();
+	hp_gov.state = st;
+	hp_gov.transitions++;
+	return 0;
+}
+
+/* Average busy percentage of the online CPUs since the last sample, -1 without NOHZ idle accounting */
+static int hp_gov_util(void)
+{
+	u64 idle = 0, wall = 0, i_us, w_us, d_idle, d_wall;
+	int cpu, util;
+
+	for_each_online_cpu(cpu) {
+		i_us = get_cpu_idle_time_us(cpu, &w_us);
+		if (i_us == (u64)-1)
+			return -1;
+		idle += i_us;
+		wall += w_us;
+	}
+	d_idle = idle - hp_gov.idle_us;
+	d_wall = wall - hp_gov.wall_us;
+	hp_gov.idle_us = idle;
+	hp_gov.wall_us = wall;
+	if (!d_wall || d_idle > d_wall)
+		return 0;
+	util = 100 - div64_u64(d_idle * 100, d_wall);
+	return util;
+}
+
+/* One governor step, with hp_gov_lock held; returns true if the profile was switched. */
+static bool hp_gov_tick(void)
+{
+	struct thermal_zone_device *tz;
+	enum hp_gov_state cur, target;
+	int util, temp = 0, r;
+
+	util = hp_gov_util();
+	if (util < 0) {
+		pr_warn("Auto profile: no CPU idle accounting, disabling\n");
+		hp_gov_account();
+		hp_gov.enabled = false;
+		return false;
+	}
+	tz = thermal_zone_get_zone_by_name(hp_gov.zone);
+	if (IS_ERR(tz) || thermal_zone_get_temp(tz, &temp))
+		temp = 0;
+	temp /= 1000;
+
+	cur = hp_gov.state;
+	hp_gov.hot = temp >= (int)(hp_gov.hot_temp - (hp_gov.hot ? hp_gov.temp_hyst : 0));
+	if (util >= (int)(hp_gov.busy_util - (cur == HP_GOV_PERFORMANCE ? hp_gov.util_hyst : 0)))
+		target = HP_GOV_PERFORMANCE;
+	else if (util <= (int)(hp_gov.idle_util + (cur == HP_GOV_COOL ? hp_gov.util_hyst : 0)))
+		target = HP_GOV_COOL;
+	else
+		target = HP_GOV_BALANCED;
+	if (hp_gov.hot && target == HP_GOV_PERFORMANCE)
+		target = HP_GOV_BALANCED;
+
+	if (target == cur ||
+	    (!(hp_gov.hot && cur == HP_GOV_PERFORMANCE) && ktime_ms_delta(ktime_get(), hp_gov.since) < hp_gov.min_dwell_ms))
+		return false;
+	r = hp_gov_switch(target);
+	if (r) {
+		pr_warn_ratelimited("Auto profile: switch to %s fail:%d\n", hp_gov_state_names[target], r);
+		return false;
+	}
+	pr_debug("Auto profile: %s (util %d%%, %d C)\n", hp_gov_state_names[target], util, temp);
+	return true;
+}
+
+static void hp_gov_work_fn(struct work_struct *work)
+{
+	bool switched;
+
+	scoped_guard(mutex, &hp_gov_lock) {
+		if (!hp_gov.enabled)
+			return;
+		switched = hp_gov_tick();
+		if (hp_gov.enabled)
+			queue_delayed_work(system_freezable_wq, &hp_gov_work, msecs_to_jiffies(hp_gov.period_ms));
+	}
+	/* Outside hp_gov_lock, see hp_wmi_profile_check() */
+	if (switched)
+		platform_profile_notify(platform_profile_dev);
+}
+
+static int hp_gov_enable(bool on)
+{
+	int st;
+
+	scoped_guard(mutex, &hp_gov_lock) {
+		if (on == hp_gov.enabled)
+			return 0;
+		if (on) {
+			st = hp_gov_state_get();
+			if (st < 0)
+				return st;
+			hp_gov.state = st;
+			hp_gov.since = ktime_get();
+			hp_gov.hot = false;
+			hp_gov_util();
+		} else {
+			hp_gov_account();
+		}
+		hp_gov.enabled = on;
+	}
+	if (on)
+		mod_delayed_work(system_freezable_wq, &hp_gov_work, msecs_to_jiffies(hp_gov.period_ms));
+	else
+		cancel_delayed_work_sync(&hp_gov_work);
+	return 0;
+}
+
+/*
+ * platform_profile was written from userspace. This runs under the platform
+ * profile lock, which the work may be waiting for, so only flag the governor
+ * off and let the work exit by itself.
+ */
+static void hp_gov_manual_override(void)
+{
+	guard(mutex)(&hp_gov_lock);
+	if (!hp_gov.enabled)
+		return;
+	pr_info("Auto profile disabled by manual profile change\n");
+	hp_gov_account();
+	hp_gov.enabled = false;
+}
+
+static ssize_t enable_show(struct device *d, struct device_attribute *a, char *b) { return sysfs_emit(b, "%d\n", READ_ONCE(hp_gov.enabled)); }
+static ssize_t enable_store(struct device *d, struct device_attribute *a, const char *buf, size_t count) { bool v; int r = kstrtobool(buf, &v); if (r)return r; r = hp_gov_enable(v); return r ? r : count; }
+static DEVICE_ATTR_RW(enable);
+
+#define HP_GOV_UINT_ATTR(_name, _min, _max)								\
+static ssize_t _name##_show(struct device *d, struct device_attribute *a, char *b) { return sysfs_emit(b, "%u\n", READ_ONCE(hp_gov._name)); } \
+static ssize_t _name##_store(struct device *d, struct device_attribute *a, const char *buf, size_t count) { unsigned int v; int r = kstrtouint(buf, 10, &v); if (r)return r; if (!in_range(v, _min, (_max) - (_min) + 1))return -EINVAL; guard(mutex)(&hp_gov_lock); hp_gov._name = v; return count; } \
+static DEVICE_ATTR_RW(_name)
+HP_GOV_UINT_ATTR(period_ms, 100, 60000);
+HP_GOV_UINT_ATTR(min_dwell_ms, 0, 600000);
+HP_GOV_UINT_ATTR(busy_util, 1, 100);
+HP_GOV_UINT_ATTR(idle_util, 0, 99);
+HP_GOV_UINT_ATTR(util_hyst, 0, 50);
+HP_GOV_UINT_ATTR(hot_temp, 40, 110);
+HP_GOV_UINT_ATTR(temp_hyst, 0, 30);
+
+static ssize_t thermal_zone_show(struct device *d, struct device_attribute *a, char *b) { guard(mutex)(&hp_gov_lock); return sysfs_emit(b, "%s\n", hp_gov.zone); }
+static ssize_t thermal_zone_store(struct device *d, struct device_attribute *a, const char *buf, size_t count)
+{
+	char name[THERMAL_NAME_LENGTH];
+	struct thermal_zone_device *tz;
+
+	if (strscpy(name, buf, sizeof(name)) < 0)
+		return -EINVAL;
+	strim(name);
+	tz = thermal_zone_get_zone_by_name(name);
+	if (IS_ERR(tz))
+		return PTR_ERR(tz);
+	guard(mutex)(&hp_gov_lock);
+	strscpy(hp_gov.zone, name, sizeof(hp_gov.zone));
+	return count;
+}
+static DEVICE_ATTR_RW(thermal_zone);
+
+static ssize_t time_in_state_show(struct device *d, struct device_attribute *a, char *b)
+{
+	int i, len = 0;
+
+	guard(mutex)(&hp_gov_lock);
+	if (hp_gov.enabled)
+		hp_gov_account();
+	for (i = 0; i < HP_GOV_STATES; i++)
+		len += sysfs_emit_at(b, len, "%s %llu\n", hp_gov_state_names[i], hp_gov.time_ms[i]);
+	return len;
+}
+static DEVICE_ATTR_RO(time_in_state);
+static ssize_t transitions_show(struct device *d, struct device_attribute *a, char *b) { guard(mutex)(&hp_gov_lock); return sysfs_emit(b, "%u\n", hp_gov.transitions); }
+static DEVICE_ATTR_RO(transitions);
+static ssize_t stats_reset_store(struct device *d, struct device_attribute *a, const char *buf, size_t count) { guard(mutex)(&hp_gov_lock); memset(hp_gov.time_ms, 0, sizeof(hp_gov.time_ms)); hp_gov.transitions = 0; hp_gov.since = ktime_get(); return count; }
+static DEVICE_ATTR_WO(stats_reset);
+
+static struct attribute *hp_gov_attrs[] = {
+	&dev_attr_enable.attr, &dev_attr_period_ms.attr, &dev_attr_min_dwell_ms.attr,
+	&dev_attr_busy_util.attr, &dev_attr_idle_util.attr, &dev_attr_util_hyst.attr,
+	&dev_attr_hot_temp.attr, &dev_attr_temp_hyst.attr, &dev_attr_thermal_zone.attr,
+	&dev_attr_time_in_state.attr, &dev_attr_transitions.attr, &dev_attr_stats_reset.attr,
+	NULL
+};
+static const struct attribute_group hp_gov_group = { .name = "auto_profile", .attrs = hp_gov_attrs };
+static bool hp_gov_registered;
+
+#define FOURZONE_COUNT 4
+#define FOURZONE_BLOCK_SIZE 128
+#define FOURZONE_FIRST_OFFSET 25
+struct color_platform { u8 b; u8 g; u8 r; } __packed;
+struct platform_zone { u8 offset; struct device_attribute *attr; char *name_ptr; };
+static struct device_attribute *zone_dev_attrs; static struct attribute **zone_attrs; static struct platform_zone *zone_data;
+static struct attribute_group zone_attribute_group = {.name = "rgb_zones"};
+
+/*
+ * Kernel-side copy of the FourZone colour block. Reads are served from it and
+ * writes patch it and push the whole block with a single COLOR_SET, so the
+ * firmware is only asked for the block when the shadow is invalid.
+ */
+static u8 fourzone_shadow[FOURZONE_BLOCK_SIZE];
+static bool fourzone_shadow_valid;
+/*
+ * The colours the user asked for. What reaches the shadow is these scaled by
+ * the zone's LED brightness, so dimming a zone never loses its colour.
+ */
+static struct color_platform fourzone_base[FOURZONE_COUNT];
+static bool fourzone_base_valid;
+static u8 fourzone_level[FOURZONE_COUNT] = { [0 ... FOURZONE_COUNT - 1] = LED_FULL };
+static DEFINE_MUTEX(fourzone_lock);
+
+static int parse_rgb(const char *buf, struct color_platform *c) { unsigned long v; int r = kstrtoul(buf, 16, &v); if (r)return r; if (v > 0xFFFFFF)return -EINVAL; c->r = v >> 16; c->g = v >> 8; c->b = v; pr_debug("hp-wmi:parsed r:%d g:%d b:%d\n", c->r, c->g, c->b); return 0; }
+static struct platform_zone *match_zone_by_attr(struct device_attribute *a) { int i; if (!zone_data || !zone_dev_attrs)return NULL; for (i = 0; i < FOURZONE_COUNT; i++)if (&zone_dev_attrs[i] == a)return &zone_data[i]; return NULL; }
+
+static void fourzone_shadow_get(int zone, struct color_platform *c)
+{
+	const u8 *p = &fourzone_shadow[FOURZONE_FIRST_OFFSET + zone * 3];
+
+	c->r = p[0]; c->g = p[1]; c->b = p[2];
+}
+
+static void fourzone_shadow_put(int zone, const struct color_platform *c)
+{
+	u8 *p = &fourzone_shadow[FOURZONE_FIRST_OFFSET + zone * 3];
+
+	p[0] = c->r; p[1] = c->g; p[2] = c->b;
+}
+
+static int fourzone_shadow_sync(void)
+{
+	int zone, r;
+
+	lockdep_assert_held(&fourzone_lock);
+	if (fourzone_shadow_valid)
+		return 0;
+	r = hp_wmi_perform_query(HPWMI_FOURZONE_COLOR_GET, HPWMI_FOURZONE, fourzone_shadow, 0, sizeof(fourzone_shadow));
+	if (r) {
+		pr_warn("fourzone_get err 0x%x\n", r);
+		return r < 0 ? r : -EIO;
+	}
+	fourzone_shadow_valid = true;
+	if (!fourzone_base_valid) {
+		for (zone = 0; zone < FOURZONE_COUNT; zone++)
+			fourzone_shadow_get(zone, &fourzone_base[zone]);
+		fourzone_base_valid = true;
+	}
+	return 0;
+}
+
+static int fourzone_shadow_commit(void)
+{
+	int r;
+
+	lockdep_assert_held(&fourzone_lock);
+	r = hp_wmi_perform_query(HPWMI_FOURZONE_COLOR_SET, HPWMI_FOURZONE, fourzone_shadow, sizeof(fourzone_shadow), 0);
+	if (r) {
+		/* Firmware state is unknown now, re-read it on next access */
+		fourzone_shadow_valid = false;
+		pr_warn("fourzone_set err 0x%x\n", r);
+		return r < 0 ? r : -EIO;
+	}
+	return 0;
+}
+
+static void fourzone_zone_output(int zone)
+{
+	struct color_platform c = fourzone_base[zone];
+	unsigned int level = fourzone_level[zone];
+
+	c.r = c.r * level / LED_FULL;
+	c.g = c.g * level / LED_FULL;
+	c.b = c.b * level / LED_FULL;
+	fourzone_shadow_put(zone, &c);
+}
+
+/*
+ * Lighting effects. Frames are computed from the time since the effect was
+ * started, so a frame that the BIOS is slow to accept simply replaces the
+ * ones that would have followed it instead of queueing behind it.
+ */
+enum fourzone_effect {
+	FOURZONE_EFFECT_NONE, FOURZONE_EFFECT_BREATHING, FOURZONE_EFFECT_CYCLE,
+	FOURZONE_EFFECT_WAVE, FOURZONE_EFFECT_FIRMWARE,
+};
+static const char * const fourzone_effect_names[] = {
+	[FOURZONE_EFFECT_NONE] = "none", [FOURZONE_EFFECT_BREATHING] = "breathing",
+	[FOURZONE_EFFECT_CYCLE] = "cycle", [FOURZONE_EFFECT_WAVE] = "wave",
+	[FOURZONE_EFFECT_FIRMWARE] = "firmware",
+};
+#define FOURZONE_HUE_MAX (6 * 256)
+static enum fourzone_effect fourzone_effect;
+static unsigned int fourzone_effect_fps = 20;
+static unsigned int fourzone_effect_period_ms = 4000;
+static u8 fourzone_fw_anim_mode = 1;
+static bool fourzone_fw_anim_supported;
+static ktime_t fourzone_effect_start;
+static void fourzone_effect_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(fourzone_effect_work, fourzone_effect_work_fn);
+
+static void fourzone_hue_to_rgb(unsigned int hue, struct color_platform *c)
+{
+	u8 x = hue & 0xff;
+
+	switch ((hue % FOURZONE_HUE_MAX) >> 8) {
+	case 0: c->r = 255; c->g = x; c->b = 0; break;
+	case 1: c->r = 255 - x; c->g = 255; c->b = 0; break;
+	case 2: c->r = 0; c->g = 255; c->b = x; break;
+	case 3: c->r = 0; c->g = 255 - x; c->b = 255; break;
+	case 4: c->r = x; c->g = 0; c->b = 255; break;
+	default: c->r = 255; c->g = 0; c->b = 255 - x; break;
+	}
+}
+
+static void fourzone_effect_frame(u32 phase, u32 period)
+{
+	struct color_platform c;
+	unsigned int level, zi;
+
+	for (zi = 0; zi < FOURZONE_COUNT; zi++) {
+		switch (fourzone_effect) {
+		case FOURZONE_EFFECT_BREATHING:
+			/* Triangle wave, squared for a softer low end */
+			level = phase < period / 2 ? phase * 512 / period : (period - phase) * 512 / period;
+			level = min(level, 255U);
+			level = level * level / 255;
+			/* On top of the zone's LED brightness, like a static colour */
+			level = level * fourzone_level[zi] / LED_FULL;
+			c.r = fourzone_base[zi].r * level / 255;
+			c.g = fourzone_base[zi].g * level / 255;
+			c.b = fourzone_base[zi].b * level / 255;
+			break;
+		case FOURZONE_EFFECT_CYCLE:
+			fourzone_hue_to_rgb((u64)phase * FOURZONE_HUE_MAX / period, &c);
+			break;
+		case FOURZONE_EFFECT_WAVE:
+			fourzone_hue_to_rgb((u64)phase * FOURZONE_HUE_MAX / period + zi * FOURZONE_HUE_MAX / FOURZONE_COUNT, &c);
+			break;
+		default:
+			return;
+		}
+		fourzone_shadow_put(zi, &c);
+	}
+}
+
+static void fourzone_effect_work_fn(struct work_struct *work)
+{
+	unsigned long frame = msecs_to_jiffies(1000 / READ_ONCE(fourzone_effect_fps));
+	unsigned long started = jiffies, spent;
+	/* One snapshot, so the phase always falls inside the period it is used with */
+	u32 period = READ_ONCE(fourzone_effect_period_ms), phase;
+
+	scoped_guard(mutex, &fourzone_lock) {
+		if (fourzone_effect == FOURZONE_EFFECT_NONE || fourzone_effect == FOURZONE_EFFECT_FIRMWARE)
+			return;
+		if (fourzone_shadow_sync())
+			goto next;
+		div_u64_rem(ktime_ms_delta(ktime_get(), fourzone_effect_start), period, &phase);
+		fourzone_effect_frame(phase, period);
+		fourzone_shadow_commit();
+	}
+next:
+	/* Never schedule behind a slow BIOS call, just drop the frames it covered */
+	spent = jiffies - started;
+	queue_delayed_work(system_freezable_wq, &fourzone_effect_work, spent < frame ? frame - spent : 1);
+}
+
+/* Firmware animation block: byte 0 selects the animation, 0 turns it off. */
+static int fourzone_fw_anim_set(u8 mode)
+{
+	u8 anim[FOURZONE_BLOCK_SIZE] = {0};
+	int r;
+
+	r = hp_wmi_perform_query(HPWMI_FOURZONE_ANIM_GET, HPWMI_FOURZONE, anim, 0, sizeof(anim));
+	if (r)
+		return r < 0 ? r : -EIO;
+	anim[0] = mode;
+	r = hp_wmi_perform_query(HPWMI_FOURZONE_ANIM_SET, HPWMI_FOURZONE, anim, sizeof(anim), 0);
+	return r ? (r < 0 ? r : -EIO) : 0;
+}
+
+static int fourzone_effect_select(enum fourzone_effect effect)
+{
+	enum fourzone_effect old;
+	int zi, r;
+
+	if (effect == FOURZONE_EFFECT_FIRMWARE && !fourzone_fw_anim_supported)
+		return -EOPNOTSUPP;
+
+	scoped_guard(mutex, &fourzone_lock) {
+		old = fourzone_effect;
+		if (old == effect)
+			return 0;
+		r = fourzone_shadow_sync();
+		if (r)
+			return r;
+		if (old == FOURZONE_EFFECT_FIRMWARE) {
+			r = fourzone_fw_anim_set(0);
+			if (r)
+				return r;
+		}
+		if (old != FOURZONE_EFFECT_NONE &&
+		    (effect == FOURZONE_EFFECT_NONE || effect == FOURZONE_EFFECT_FIRMWARE)) {
+			/* Put the user's colours back underneath */
+			for (zi = 0; zi < FOURZONE_COUNT; zi++)
+				fourzone_zone_output(zi);
+			fourzone_shadow_commit();
+		}
+		if (effect == FOURZONE_EFFECT_FIRMWARE) {
+			r = fourzone_fw_anim_set(fourzone_fw_anim_mode);
+			if (r)
+				return r;
+		}
+		fourzone_effect = effect;
+		fourzone_effect_start = ktime_get();
+	}
+
+	if (effect == FOURZONE_EFFECT_NONE || effect == FOURZONE_EFFECT_FIRMWARE)
+		cancel_delayed_work_sync(&fourzone_effect_work);
+	else
+		mod_delayed_work(system_freezable_wq, &fourzone_effect_work, 0);
+	return 0;
+}
+
+static ssize_t effect_show(struct device *d, struct device_attribute *a, char *b)
+{
+	int i, len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(fourzone_effect_names); i++)
+		len += sysfs_emit_at(b, len, i == fourzone_effect ? "[%s]%c" : "%s%c", fourzone_effect_names[i],
+				     i == ARRAY_SIZE(fourzone_effect_names) - 1 ? '\n' : ' ');
+	return len;
+}
+
+static ssize_t effect_store(struct device *d, struct device_attribute *a, const char *buf, size_t count)
+{
+	int i = sysfs_match_string(fourzone_effect_names, buf), r;
+
+	if (i < 0)
+		return i;
+	r = fourzone_effect_select(i);
+	return r ? r : count;
+}
+static DEVICE_ATTR_RW(effect);
+
+static ssize_t effect_fps_show(struct device *d, struct device_attribute *a, char *b) { return sysfs_emit(b, "%u\n", READ_ONCE(fourzone_effect_fps)); }
+static ssize_t effect_fps_store(struct device *d, struct device_attribute *a, const char *buf, size_t count) { unsigned int v; int r = kstrtouint(buf, 10, &v); if (r)return r; if (!v || v > 60)return -EINVAL; WRITE_ONCE(fourzone_effect_fps, v); return count; }
+static DEVICE_ATTR_RW(effect_fps);
+static ssize_t effect_period_ms_show(struct device *d, struct device_attribute *a, char *b) { return sysfs_emit(b, "%u\n", READ_ONCE(fourzone_effect_period_ms)); }
+static ssize_t effect_period_ms_store(struct device *d, struct device_attribute *a, const char *buf, size_t count) { unsigned int v; int r = kstrtouint(buf, 10, &v); if (r)return r; if (v < 100 || v > 60000)return -EINVAL; WRITE_ONCE(fourzone_effect_period_ms, v); return count; }
+static DEVICE_ATTR_RW(effect_period_ms);
+
+static ssize_t effect_fw_mode_show(struct device *d, struct device_attribute *a, char *b) { return sysfs_emit(b, "%u\n", fourzone_fw_anim_mode); }
+static ssize_t effect_fw_mode_store(struct device *d, struct device_attribute *a, const char *buf, size_t count)
+{
+	u8 v;
+	int r = kstrtou8(buf, 0, &v);
+
+	if (r)
+		return r;
+	if (!v)
+		return -EINVAL;
+	guard(mutex)(&fourzone_lock);
+	fourzone_fw_anim_mode = v;
+	if (fourzone_effect == FOURZONE_EFFECT_FIRMWARE) {
+		r = fourzone_fw_anim_set(v);
+		if (r)
+			return r;
+	}
+	return count;
+}
+static DEVICE_ATTR_RW(effect_fw_mode);
+
+static void fourzone_led_intensity_update(int zone);
+
+/* Replace the colours of the zones set in @mask with one firmware write. */
+static int fourzone_put_colors(unsigned long mask, const struct color_platform *c)
+{
+	int zi, r;
+
+	lockdep_assert_held(&fourzone_lock);
+	r = fourzone_shadow_sync();
+	if (r)
+		return r;
+	for_each_set_bit(zi, &mask, FOURZONE_COUNT) {
+		fourzone_base[zi] = c[zi];
+		fourzone_zone_output(zi);
+		fourzone_led_intensity_update(zi);
+	}
+	return fourzone_shadow_commit();
+}
+
+static int fourzone_set_colors(unsigned long mask, const struct color_platform *c)
+{
+	guard(mutex)(&fourzone_lock);
+	return fourzone_put_colors(mask, c);
+}
+
+static int fourzone_get_colors(struct color_platform *c)
+{
+	int zi, r;
+
+	guard(mutex)(&fourzone_lock);
+	r = fourzone_shadow_sync();
+	if (r)
+		return r;
+	memcpy(c, fourzone_base, sizeof(fourzone_base));
+	return 0;
+}
+
+static ssize_t zone_show(struct device *d, struct device_attribute *a, char *b) { struct platform_zone *tz = match_zone_by_attr(a); struct color_platform c[FOURZONE_COUNT]; int r, zi; if (!tz)return -EINVAL; zi = tz - zone_data; r = fourzone_get_colors(c); if (r)return sysfs_emit(b, "Err read zone:%d\n", r); return sysfs_emit(b, "RGB:%02x%02x%02x (R:%d G:%d B:%d)\n", c[zi].r, c[zi].g, c[zi].b, c[zi].r, c[zi].g, c[zi].b); }
+static ssize_t zone_set(struct device *d, struct device_attribute *a, const char *buf, size_t count) { struct platform_zone *tz = match_zone_by_attr(a); struct color_platform c[FOURZONE_COUNT]; int r, zi; if (!tz)return -EINVAL; zi = tz - zone_data; r = parse_rgb(buf, &c[zi]); if (r)return r; guard(rwsem_read)(&hp_wmi_ctl_rwsem); r = fourzone_set_colors(BIT(zi), c); return r ? r : count; }
+
+static ssize_t all_zones_rgb_show(struct device *d, struct device_attribute *a, char *b)
+{
+	struct color_platform c[FOURZONE_COUNT];
+	int zi, len = 0, r;
+
+	r = fourzone_get_colors(c);
+	if (r)
+		return r;
+	for (zi = 0; zi < FOURZONE_COUNT; zi++)
+		len += sysfs_emit_at(b, len, "%02x%02x%02x%c", c[zi].r, c[zi].g, c[zi].b, zi == FOURZONE_COUNT - 1 ? '\n' : ' ');
+	return len;
+}
+
+/* Accepts FOURZONE_COUNT hex RGB values separated by spaces or commas. */
+static ssize_t all_zones_rgb_store(struct device *d, struct device_attribute *a, const char *buf, size_t count)
+{
+	struct color_platform c[FOURZONE_COUNT];
+	char tmp[64], *p = tmp, *tok;
+	int zi = 0, r;
+
+	if (count >= sizeof(tmp))
+		return -EINVAL;
+	memcpy(tmp, buf, count);
+	tmp[count] = '\0';
+	while ((tok = strsep(&p, " ,\t\n"))) {
+		if (!*tok)
+			continue;
+		if (zi == FOURZONE_COUNT)
+			return -EINVAL;
+		r = parse_rgb(tok, &c[zi++]);
+		if (r)
+			return r;
+	}
+	if (zi != FOURZONE_COUNT)
+		return -EINVAL;
+	guard(rwsem_read)(&hp_wmi_ctl_rwsem);
+	r = fourzone_set_colors(GENMASK(FOURZONE_COUNT - 1, 0), c);
+	return r ? r : count;
+}
+static DEVICE_ATTR_RW(all_zones_rgb);
+static struct attribute *fourzone_extra_attrs[] = {
+	&dev_attr_all_zones_rgb.attr, &dev_attr_effect.attr, &dev_attr_effect_fps.attr,
+	&dev_attr_effect_period_ms.attr, &dev_attr_effect_fw_mode.attr,
+};
+
+/*
+ * Each zone is also a multicolor LED so kernel triggers can drive it. The
+ * LED brightness scales the zone colour, and the keyboard backlight itself
+ * is switched through FOURZONE_BRIGHT_SET when every zone is off or one
+ * comes back on.
+ */
+#define FOURZONE_BACKLIGHT_ON	0xE4
+#define FOURZONE_BACKLIGHT_OFF	0x64
+#define FOURZONE_BACKLIGHT_MASK	0x80
+struct fourzone_led { struct led_classdev_mc mc; struct mc_subled subled[3]; char name[24]; };
+static struct fourzone_led fourzone_leds[FOURZONE_COUNT];
+static bool fourzone_leds_registered;
+static int fourzone_backlight = -1;
+
+static int fourzone_backlight_get(void)
+{
+	u8 b[4] = {0};
+	int r = hp_wmi_perform_query(HPWMI_FOURZONE_BRIGHT_GET, HPWMI_FOURZONE, b, 0, sizeof(b));
+
+	if (r)
+		return r < 0 ? r : -EIO;
+	return !!(b[0] & FOURZONE_BACKLIGHT_MASK);
+}
+
+static int fourzone_backlight_set(bool on)
+{
+	u8 b[4] = { on ? FOURZONE_BACKLIGHT_ON : FOURZONE_BACKLIGHT_OFF };
+	int r;
+
+	lockdep_assert_held(&fourzone_lock);
+	if (fourzone_backlight == on)
+		return 0;
+	r = hp_wmi_perform_query(HPWMI_FOURZONE_BRIGHT_SET, HPWMI_FOURZONE, b, sizeof(b), 0);
+	if (r)
+		return r < 0 ? r : -EIO;
+	fourzone_backlight = on;
+	return 0;
+}
+
+static int fourzone_led_set(struct led_classdev *cdev, enum led_brightness brightness)
+{
+	struct led_classdev_mc *mc = lcdev_to_mccdev(cdev);
+	struct fourzone_led *led = container_of(mc, struct fourzone_led, mc);
+	struct color_platform c[FOURZONE_COUNT];
+	int zi = led - fourzone_leds, i, r;
+	bool on = false;
+
+	guard(rwsem_read)(&hp_wmi_ctl_rwsem);
+	guard(mutex)(&fourzone_lock);
+	/* multi_intensity is the zone colour, brightness only scales what is shown */
+	c[zi].r = led->subled[0].intensity;
+	c[zi].g = led->subled[1].intensity;
+	c[zi].b = led->subled[2].intensity;
+	fourzone_level[zi] = brightness;
+	r = fourzone_put_colors(BIT(zi), c);
+	if (r)
+		return r;
+
+	for (i = 0; i < FOURZONE_COUNT; i++)
+		on |= i == zi ? brightness != LED_OFF : fourzone_leds[i].mc.led_cdev.brightness != LED_OFF;
+	return fourzone_backlight_set(on);
+}
+
+static void fourzone_led_intensity_update(int zone)
+{
+	struct mc_subled *subled = fourzone_leds[zone].subled;
+
+	lockdep_assert_held(&fourzone_lock);
+	subled[0].intensity = fourzone_base[zone].r;
+	subled[1].intensity = fourzone_base[zone].g;
+	subled[2].intensity = fourzone_base[zone].b;
+}
+
+static int fourzone_leds_setup(struct platform_device *pdev)
+{
+	struct color_platform c[FOURZONE_COUNT];
+	int zi, r, on;
+
+	r = fourzone_get_colors(c);
+	if (r)
+		return r;
+	on = fourzone_backlight_get();
+	if (on < 0)
+		return on;
+	fourzone_backlight = on;
+
+	for (zi = 0; zi < FOURZONE_COUNT; zi++) {
+		struct fourzone_led *led = &fourzone_leds[zi];
+
+		led->subled[0] = (struct mc_subled){ .color_index = LED_COLOR_ID_RED, .intensity = c[zi].r, .channel = 0 };
+		led->subled[1] = (struct mc_subled){ .color_index = LED_COLOR_ID_GREEN, .intensity = c[zi].g, .channel = 1 };
+		led->subled[2] = (struct mc_subled){ .color_index = LED_COLOR_ID_BLUE, .intensity = c[zi].b, .channel = 2 };
+		snprintf(led->name, sizeof(led->name), "hp:rgb:kbd_zone%d", zi);
+		led->mc.subled_info = led->subled;
+		led->mc.num_colors = ARRAY_SIZE(led->subled);
+		led->mc.led_cdev.name = led->name;
+		led->mc.led_cdev.max_brightness = LED_FULL;
+		led->mc.led_cdev.brightness = on ? LED_FULL : LED_OFF;
+		/* Unbinding must not switch the keyboard off */
+		led->mc.led_cdev.flags = LED_BRIGHT_HW_CHANGED | LED_RETAIN_AT_SHUTDOWN;
+		led->mc.led_cdev.brightness_set_blocking = fourzone_led_set;
+		r = led_classdev_multicolor_register(&pdev->dev, &led->mc);
+		if (r)
+			goto err_unregister;
+	}
+	WRITE_ONCE(fourzone_leds_registered, true);
+	return 0;
+
+err_unregister:
+	while (zi--)
+		led_classdev_multicolor_unregister(&fourzone_leds[zi].mc);
+	return r;
+}
+
+/*
+ * The event worker outlives the platform device, so stop it from reaching
+ * the LEDs before they go away.
+ */
+static void fourzone_leds_remove(void)
+{
+	int zi;
+
+	if (!fourzone_leds_registered)
+		return;
+	WRITE_ONCE(fourzone_leds_registered, false);
+	flush_work(&hp_wmi_event_work);
+	for (zi = 0; zi < FOURZONE_COUNT; zi++)
+		led_classdev_multicolor_unregister(&fourzone_leds[zi].mc);
+}
+
+/* HPWMI_BACKLIT_KB_BRIGHTNESS: the backlight was toggled by the firmware hotkey */
+static void fourzone_backlight_changed(void)
+{
+	int zi, on;
+
+	if (!READ_ONCE(fourzone_leds_registered))
+		return;
+	on = fourzone_backlight_get();
+	if (on < 0)
+		return;
+	scoped_guard(mutex, &fourzone_lock)
+		fourzone_backlight = on;
+	for (zi = 0; zi < FOURZONE_COUNT; zi++) {
+		struct led_classdev *cdev = &fourzone_leds[zi].mc.led_cdev;
+
+		led_classdev_notify_brightness_hw_changed(cdev, on ? (cdev->brightness ?: cdev->max_brightness) : LED_OFF);
+	}
+}
+
+static int fourzone_setup(struct platform_device *pdev) {
+	int zi, err = 0; char nb[16]; if (!test_bit(HPWMI_CAP_FOURZONE, hp_wmi_caps))return 0;
+	zone_dev_attrs = kcalloc(FOURZONE_COUNT, sizeof(*zone_dev_attrs), GFP_KERNEL); if (!zone_dev_attrs)return -ENOMEM;
+	zone_attrs = kcalloc(FOURZONE_COUNT + ARRAY_SIZE(fourzone_extra_attrs) + 1, sizeof(*zone_attrs), GFP_KERNEL); if (!zone_attrs) { kfree(zone_dev_attrs); zone_dev_attrs = NULL; return -ENOMEM; }
+	zone_data = kcalloc(FOURZONE_COUNT, sizeof(*zone_data), GFP_KERNEL); if (!zone_data) { kfree(zone_attrs); zone_attrs = NULL; kfree(zone_dev_attrs); zone_dev_attrs = NULL; return -ENOMEM; }
+	for (zi = 0; zi < FOURZONE_COUNT; zi++) { snprintf(nb, sizeof(nb), "zone%02X_rgb", zi); zone_data[zi].name_ptr = kstrdup(nb, GFP_KERNEL); if (!zone_data[zi].name_ptr) { err = -ENOMEM; goto err_fourzone; } sysfs_attr_init(&zone_dev_attrs[zi].attr); zone_dev_attrs[zi].attr.name = zone_data[zi].name_ptr; zone_dev_attrs[zi].attr.mode = 0644; zone_dev_attrs[zi].show = zone_show; zone_dev_attrs[zi].store = zone_set; zone_data[zi].offset = FOURZONE_FIRST_OFFSET + (zi * 3); zone_data[zi].attr = &zone_dev_attrs[zi]; zone_attrs[zi] = &zone_dev_attrs[zi].attr; }
+	memcpy(&zone_attrs[FOURZONE_COUNT], fourzone_extra_attrs, sizeof(fourzone_extra_attrs)); zone_attrs[FOURZONE_COUNT + ARRAY_SIZE(fourzone_extra_attrs)] = NULL;
+	fourzone_fw_anim_supported = test_bit(HPWMI_CAP_FOURZONE_ANIM, hp_wmi_caps);
+	zone_attribute_group.attrs = zone_attrs; err = sysfs_create_group(&pdev->dev.kobj, &zone_attribute_group); if (err)goto err_fourzone;
+	err = fourzone_leds_setup(pdev); if (err)pr_warn("Fail FourZone LED setup:%d\n", err);
+	return 0;
+err_fourzone: for (zi--; zi >= 0; zi--)kfree(zone_data[zi].name_ptr); kfree(zone_data); zone_data = NULL; kfree(zone_attrs); zone_attrs = NULL; kfree(zone_dev_attrs); zone_dev_attrs = NULL; return err;
+}
+static void fourzone_remove(struct platform_device *pdev) {
+	int i; fourzone_leds_remove(); if (zone_attribute_group.attrs) { scoped_guard(mutex, &fourzone_lock) fourzone_effect = FOURZONE_EFFECT_NONE; cancel_delayed_work_sync(&fourzone_effect_work); sysfs_remove_group(&pdev->dev.kobj, &zone_attribute_group); if (zone_data)for (i = 0; i < FOURZONE_COUNT; i++)kfree(zone_data[i].name_ptr); kfree(zone_data); zone_data = NULL; kfree(zone_attrs); zone_attrs = NULL; kfree(zone_dev_attrs); zone_dev_attrs = NULL; zone_attribute_group.attrs = NULL; }
+}
+
+/*
+ * Some BIOSes reset the lighting across suspend. The shadow still holds the
+ * colours set before it, so compare them with the firmware block and write
+ * them back only if they differ; the same goes for the backlight switch.
+ */
+static void fourzone_resume(void)
+{
+	u8 fw[FOURZONE_BLOCK_SIZE];
+	int on, want, r;
+
+	if (!zone_attribute_group.attrs)
+		return;
+	guard(mutex)(&fourzone_lock);
+	if (!fourzone_shadow_valid) {
+		fourzone_backlight = -1;
+		fourzone_shadow_sync();
+		return;
+	}
+	r = hp_wmi_perform_query(HPWMI_FOURZONE_COLOR_GET, HPWMI_FOURZONE, fw, 0, sizeof(fw));
+	if (r || memcmp(&fw[FOURZONE_FIRST_OFFSET], &fourzone_shadow[FOURZONE_FIRST_OFFSET], FOURZONE_COUNT * 3))
+		fourzone_shadow_commit();
+
+	if (fourzone_backlight < 0)
+		return;
+	on = fourzone_backlight_get();
+	if (on < 0 || on == fourzone_backlight)
+		return;
+	want = fourzone_backlight;
+	fourzone_backlight = on;
+	fourzone_backlight_set(want);
+}
+static int thermal_profile_setup(void) {
+	struct device *dev = &hp_wmi_platform_dev->dev;
+	unsigned long choices_mask = 0;
+	int err;
+	struct platform_profile_ops *selected_ops;
+
+	set_bit(PLATFORM_PROFILE_COOL, &choices_mask);
+	set_bit(PLATFORM_PROFILE_BALANCED, &choices_mask);
+	set_bit(PLATFORM_PROFILE_PERFORMANCE, &choices_mask);
+
+	/* The profile was read during discovery; writing it back would change nothing */
+	if (!test_bit(HPWMI_CAP_THERMAL, hp_wmi_caps)) { pr_warn("Fail get thermal profile:%d\n", hp_wmi_profile_boot); return hp_wmi_profile_boot; }
+	if (is_omen_thermal_profile()) {
+		hp_wmi_omen_profile_ops.profile_get = platform_profile_omen_get;
+		hp_wmi_omen_profile_ops.profile_set = platform_profile_omen_set;
+		selected_ops = &hp_wmi_omen_profile_ops;
+	} else {
+		hp_wmi_profile_ops.profile_get = hp_wmi_platform_profile_get;
+		hp_wmi_profile_ops.profile_set = hp_wmi_platform_profile_set;
+		selected_ops = &hp_wmi_profile_ops;
+	}
+
+	platform_profile_dev = platform_profile_register(dev, "hp-wmi", &choices_mask, selected_ops);
+	if (IS_ERR(platform_profile_dev)) {
+		err = PTR_ERR(platform_profile_dev);
+		pr_err("Fail register platform profile:%d\n", err);
+		platform_profile_dev = NULL;
+		return err;
+	}
+	platform_profile_support = true;
+	hp_wmi_watch_start(hp_wmi_profile_boot);
+	hp_gov_registered = !sysfs_create_group(&dev->kobj, &hp_gov_group);
+	if (!hp_gov_registered)
+		pr_warn("Fail create auto_profile group\n");
+	return 0;
+}
+/*
+ * /dev/hp-wmi-ctl: a whole mode switch (profile, fans, lighting) in one
+ * syscall. The transaction holds hp_wmi_ctl_rwsem for writing. The
+ * platform_profile, governor, zone, LED and hwmon writers take it for
+ * reading, so none of them can interleave with it. Background work does not
+ * take it: a running lighting effect, the fan curve and the resume restore
+ * still write the firmware, and the profile watcher keeps reading it.
+ */
+static bool hp_wmi_ctl_registered;
+
+static bool hp_wmi_ctl_is_write(const struct hp_wmi_ctl_op *op, u32 type)
+{
+	return op->type == type && !(op->flags & HP_WMI_CTL_OP_READ);
+}
+
+static int hp_wmi_ctl_check(const struct hp_wmi_ctl_op *op)
+{
+	bool rd = op->flags & HP_WMI_CTL_OP_READ;
+
+	if ((op->flags & ~HP_WMI_CTL_OP_READ) || op->reserved)
+		return -EINVAL;
+	switch (op->type) {
+	case HP_WMI_CTL_PROFILE:
+		if (!platform_profile_support)
+			return -EOPNOTSUPP;
+		return rd || op->value <= HP_WMI_CTL_PROFILE_PERFORMANCE ? 0 : -EINVAL;
+	case HP_WMI_CTL_FAN_MAX:
+		if (!hp_wmi_board_may(HPWMI_BOARD_GM))
+			return -EOPNOTSUPP;
+		return rd || op->value <= 1 ? 0 : -EINVAL;
+	case HP_WMI_CTL_ZONE_COLOR:
+		if (!zone_attribute_group.attrs)
+			return -EOPNOTSUPP;
+		return op->index < FOURZONE_COUNT && (rd || op->value <= 0xFFFFFF) ? 0 : -EINVAL;
+	case HP_WMI_CTL_BRIGHTNESS:
+		if (!zone_attribute_group.attrs)
+			return -EOPNOTSUPP;
+		return rd || op->value <= 1 ? 0 : -EINVAL;
+	}
+	return -EINVAL;
+}
+
+static int hp_wmi_ctl_read(struct hp_wmi_ctl_op *op)
+{
+	struct color_platform c[FOURZONE_COUNT];
+	int r;
+
+	switch (op->type) {
+	case HP_WMI_CTL_PROFILE:
+		r = hp_wmi_profile_raw();
+		if (r < 0)
+			break;
+		switch (hp_wmi_power_slot(r)) {
+		case HP_POWER_COOL:
+			r = HP_WMI_CTL_PROFILE_COOL;
+			break;
+		case HP_POWER_BALANCED:
+			r = HP_WMI_CTL_PROFILE_BALANCED;
+			break;
+		case HP_POWER_PERFORMANCE:
+			r = HP_WMI_CTL_PROFILE_PERFORMANCE;
+			break;
+		default:
+			r = -EINVAL;
+		}
+		break;
+	case HP_WMI_CTL_FAN_MAX:
+		r = hp_wmi_fan_speed_max_get();
+		break;
+	case HP_WMI_CTL_ZONE_COLOR:
+		r = fourzone_get_colors(c);
+		if (r)
+			return r;
+		r = c[op->index].r << 16 | c[op->index].g << 8 | c[op->index].b;
+		break;
+	case HP_WMI_CTL_BRIGHTNESS:
+		r = fourzone_backlight_get();
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (r < 0)
+		return r;
+	op->value = r;
+	return 0;
+}
+
+static int hp_wmi_ctl_write(const struct hp_wmi_ctl_op *op, bool *profile)
+{
+	int tp, r;
+
+	switch (op->type) {
+	case HP_WMI_CTL_PROFILE:
+		/* HP_WMI_CTL_PROFILE_* are in governor state order */
+		BUILD_BUG_ON(HP_WMI_CTL_PROFILE_COOL != HP_GOV_COOL);
+		BUILD_BUG_ON(HP_WMI_CTL_PROFILE_BALANCED != HP_GOV_BALANCED);
+		BUILD_BUG_ON(HP_WMI_CTL_PROFILE_PERFORMANCE != HP_GOV_PERFORMANCE);
+		if (is_omen_thermal_profile()) {
+			tp = hp_gov_omen_tp[op->value];
+			r = omen_thermal_profile_set(tp);
+		} else {
+			tp = hp_gov_generic_tp[op->value];
+			r = generic_thermal_profile_set_wmi(tp);
+		}
+		if (r)
+			return r < 0 ? r : -EIO;
+		hp_wmi_profile_written(tp);
+		*profile = true;
+		return 0;
+	case HP_WMI_CTL_FAN_MAX:
+		return hp_wmi_fan_mode_set(op->value ? HPWMI_FAN_MODE_FULL : HPWMI_FAN_MODE_BIOS);
+	case HP_WMI_CTL_BRIGHTNESS:
+		scoped_guard(mutex, &fourzone_lock)
+			r = fourzone_backlight_set(op->value);
+		/* Tell the LED class devices, as for the hotkey */
+		if (!r)
+			fourzone_backlight_changed();
+		return r;
+	}
+	return -EINVAL;
+}
+
+static int hp_wmi_ctl_run(struct hp_wmi_ctl_op *ops, u32 n, bool *profile)
+{
+	struct color_platform c[FOURZONE_COUNT];
+	unsigned long mask;
+	u32 i, j, k;
+	int r, err = 0;
+
+	for (i = 0; i < n; i = j) {
+		j = i + 1;
+		if (err) {
+			ops[i].result = -ECANCELED;
+			continue;
+		}
+		if (ops[i].flags & HP_WMI_CTL_OP_READ) {
+			r = hp_wmi_ctl_read(&ops[i]);
+		} else if (ops[i].type == HP_WMI_CTL_ZONE_COLOR) {
+			/* A run of zone colours patches the shadow and is sent as one COLOR_SET */
+			for (mask = 0, j = i; j < n && hp_wmi_ctl_is_write(&ops[j], HP_WMI_CTL_ZONE_COLOR); j++) {
+				k = ops[j].index;
+				c[k].r = ops[j].value >> 16;
+				c[k].g = ops[j].value >> 8;
+				c[k].b = ops[j].value;
+				mask |= BIT(k);
+			}
+			r = fourzone_set_colors(mask, c);
+		} else {
+			/* Back-to-back writes of one setting: only the last one reaches the BIOS */
+			while (j < n && hp_wmi_ctl_is_write(&ops[j], ops[i].type))
+				j++;
+			r = hp_wmi_ctl_write(&ops[j - 1], profile);
+		}
+		for (k = i; k < j; k++)
+			ops[k].result = r;
+		if (r)
+			err = r;
+	}
+	return err;
+}
+
+static long hp_wmi_ctl_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct hp_wmi_ctl_transaction tx;
+	struct hp_wmi_ctl_op *ops;
+	bool profile = false;
+	int r = 0;
+	u32 i;
+
+	if (cmd != HP_WMI_IOC_CTL_TRANSACT)
+		return -ENOTTY;
+	if (copy_from_user(&tx, (void __user *)arg, sizeof(tx)))
+		return -EFAULT;
+	if (tx.flags || !tx.count || tx.count > HP_WMI_CTL_MAX_OPS)
+		return -EINVAL;
+	ops = memdup_array_user(u64_to_user_ptr(tx.ops), tx.count, sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	for (i = 0; i < tx.count; i++) {
+		ops[i].result = hp_wmi_ctl_check(&ops[i]);
+		if (ops[i].result && !r)
+			r = ops[i].result;
+	}
+	if (r)
+		goto out;
+	/* Like a platform_profile write; done first as the governor work takes the rwsem under its lock */
+	for (i = 0; i < tx.count; i++) {
+		if (hp_wmi_ctl_is_write(&ops[i], HP_WMI_CTL_PROFILE)) {
+			hp_gov_manual_override();
+			break;
+		}
+	}
+	scoped_guard(rwsem_write, &hp_wmi_ctl_rwsem)
+		r = hp_wmi_ctl_run(ops, tx.count, &profile);
+	if (profile)
+		platform_profile_notify(platform_profile_dev);
+out:
+	if (copy_to_user(u64_to_user_ptr(tx.ops), ops, tx.count * sizeof(*ops)))
+		r = -EFAULT;
+	kfree(ops);
+	return r;
+}
+
+static const struct file_operations hp_wmi_ctl_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = hp_wmi_ctl_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice hp_wmi_ctl = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "hp-wmi-ctl",
+	.fops = &hp_wmi_ctl_fops,
+	.mode = 0600,
+};
+
+static void hp_wmi_ctl_init(void)
+{
+	int err = misc_register(&hp_wmi_ctl);
+
+	if (err)
+		pr_warn("Fail register control device:%d\n", err);
+	hp_wmi_ctl_registered = !err;
+}
+
+static void hp_wmi_ctl_exit(void)
+{
+	if (hp_wmi_ctl_registered)
+		misc_deregister(&hp_wmi_ctl);
+	hp_wmi_ctl_registered = false;
+}
+
+/*
+ * IIO view of the ambient light and drive temperature sensors. In buffered
+ * mode a work item samples the enabled channels at sampling_frequency and
+ * pushes timestamped scans into the IIO kfifo, so readers get them in bulk
+ * from the chardev. Samples bypass the read cache, whose TTL would repeat
+ * values at higher rates; the sysfs files keep using it.
+ */
+enum { HP_IIO_ALS, HP_IIO_HDDTEMP, HP_IIO_CHANNELS };
+static const struct iio_chan_spec hp_wmi_iio_channels[HP_IIO_CHANNELS] = {
+	[HP_IIO_ALS] = {
+		.type = IIO_LIGHT,
+		.address = HPWMI_ALS_QUERY,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
+		.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+		.scan_type = { .sign = 'u', .realbits = 32, .storagebits = 32, .endianness = IIO_CPU },
+	},
+	[HP_IIO_HDDTEMP] = {
+		.type = IIO_TEMP,
+		.address = HPWMI_HDDTEMP_QUERY,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE),
+		.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+		.scan_type = { .sign = 's', .realbits = 32, .storagebits = 32, .endianness = IIO_CPU },
+	},
+};
+static const int hp_wmi_iio_caps[HP_IIO_CHANNELS] = { [HP_IIO_ALS] = HPWMI_CAP_ALS, [HP_IIO_HDDTEMP] = HPWMI_CAP_HDDTEMP };
+#define HP_IIO_FREQ_MIN_UHZ	100000		/* 0.1 Hz */
+#define HP_IIO_FREQ_MAX_UHZ	50000000	/* 50 Hz */
+
+struct hp_wmi_iio {
+	struct iio_dev *indio;
+	struct delayed_work work;
+	unsigned int period_us;
+	struct iio_chan_spec channels[HP_IIO_CHANNELS + 1];
+};
+
+static void hp_wmi_iio_work_fn(struct work_struct *work)
+{
+	struct hp_wmi_iio *st = container_of(to_delayed_work(work), struct hp_wmi_iio, work);
+	struct iio_dev *indio = st->indio;
+	struct { u32 val[HP_IIO_CHANNELS]; aligned_s64 ts; } scan = {};
+	unsigned long started = jiffies, period, spent;
+	s64 ts = iio_get_time_ns(indio);
+	int bit, i = 0, r, v;
+
+	iio_for_each_active_channel(indio, bit) {
+		if (st->channels[bit].type == IIO_TIMESTAMP)
+			continue;
+		v = 0;
+		r = hp_wmi_perform_query(st->channels[bit].address, HPWMI_READ, &v, sizeof(v), sizeof(v));
+		/* Drop the whole scan rather than push a hole in it */
+		if (r)
+			goto next;
+		scan.val[i++] = v;
+	}
+	iio_push_to_buffers_with_timestamp(indio, &scan, ts);
+next:
+	/* Like the effect frames: a slow BIOS call eats into the period, it does not queue up behind it */
+	period = usecs_to_jiffies(READ_ONCE(st->period_us));
+	spent = jiffies - started;
+	queue_delayed_work(system_freezable_wq, &st->work, spent < period ? period - spent : 1);
+}
+
+static int hp_wmi_iio_read_raw(struct iio_dev *indio, struct iio_chan_spec const *chan, int *val, int *val2, long mask)
+{
+	struct hp_wmi_iio *st = iio_priv(indio);
+	u64 uhz;
+	u32 rem;
+	int v;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		v = hp_wmi_read_int(chan->address);
+		if (v < 0)
+			return v;
+		*val = v;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		/* The BIOS reports whole degrees C */
+		*val = MILLIDEGREE_PER_DEGREE;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		uhz = div_u64(1000000ULL * USEC_PER_SEC, READ_ONCE(st->period_us));
+		*val = div_u64_rem(uhz, 1000000, &rem);
+		*val2 = rem;
+		return IIO_VAL_INT_PLUS_MICRO;
+	}
+	return -EINVAL;
+}
+
+static int hp_wmi_iio_write_raw(struct iio_dev *indio, struct iio_chan_spec const *chan, int val, int val2, long mask)
+{
+	struct hp_wmi_iio *st = iio_priv(indio);
+	u64 uhz;
+
+	if (mask != IIO_CHAN_INFO_SAMP_FREQ)
+		return -EINVAL;
+	if (val < 0 || val2 < 0)
+		return -EINVAL;
+	uhz = (u64)val * 1000000 + val2;
+	if (uhz < HP_IIO_FREQ_MIN_UHZ || uhz > HP_IIO_FREQ_MAX_UHZ)
+		return -EINVAL;
+	WRITE_ONCE(st->period_us, div64_u64(1000000ULL * USEC_PER_SEC, uhz));
+	if (iio_buffer_enabled(indio))
+		mod_delayed_work(system_freezable_wq, &st->work, 0);
+	return 0;
+}
+
+static const struct iio_info hp_wmi_iio_info = {
+	.read_raw = hp_wmi_iio_read_raw,
+	.write_raw = hp_wmi_iio_write_raw,
+};
+
+static int hp_wmi_iio_postenable(struct iio_dev *indio)
+{
+	struct hp_wmi_iio *st = iio_priv(indio);
+
+	queue_delayed_work(system_freezable_wq, &st->work, 0);
+	return 0;
+}
+
+static int hp_wmi_iio_predisable(struct iio_dev *indio)
+{
+	struct hp_wmi_iio *st = iio_priv(indio);
+
+	cancel_delayed_work_sync(&st->work);
 	return 0;
 }
+
+static const struct iio_buffer_setup_ops hp_wmi_iio_buffer_ops = {
+	.postenable = hp_wmi_iio_postenable,
+	.predisable = hp_wmi_iio_predisable,
+};
+
+/* Device-managed: unregistering disables the buffer, which stops the sampler */
+static void hp_wmi_iio_setup(struct platform_device *pdev)
+{
+	struct hp_wmi_iio *st;
+	struct iio_dev *indio;
+	int i, n = 0, err;
+
+	for (i = 0; i < HP_IIO_CHANNELS; i++)
+		n += test_bit(hp_wmi_iio_caps[i], hp_wmi_caps);
+	if (!n)
+		return;
+	indio = devm_iio_device_alloc(&pdev->dev, sizeof(*st));
+	if (!indio) {
+		pr_warn("Fail alloc IIO device\n");
+		return;
+	}
+	st = iio_priv(indio);
+	st->indio = indio;
+	st->period_us = USEC_PER_SEC;
+	INIT_DELAYED_WORK(&st->work, hp_wmi_iio_work_fn);
+	for (i = 0, n = 0; i < HP_IIO_CHANNELS; i++) {
+		if (!test_bit(hp_wmi_iio_caps[i], hp_wmi_caps))
+			continue;
+		st->channels[n] = hp_wmi_iio_channels[i];
+		st->channels[n].scan_index = n;
+		n++;
+	}
+	st->channels[n] = (struct iio_chan_spec)IIO_CHAN_SOFT_TIMESTAMP(n);
+
+	indio->name = "hp-wmi";
+	indio->info = &hp_wmi_iio_info;
+	indio->channels = st->channels;
+	indio->num_channels = n + 1;
+	indio->modes = INDIO_DIRECT_MODE;
+	err = devm_iio_kfifo_buffer_setup(&pdev->dev, indio, &hp_wmi_iio_buffer_ops);
+	if (!err)
+		err = devm_iio_device_register(&pdev->dev, indio);
+	if (err)
+		pr_warn("Fail register IIO device:%d\n", err);
+}
 static int hp_wmi_hwmon_init(void);
-static int __init hp_wmi_bios_setup(struct platform_device *device) {
-	int err; wifi_rfkill = NULL; bluetooth_rfkill = NULL; wwan_rfkill = NULL; rfkill2_count = 0;
-	if (hp_wmi_rfkill_setup(device) != 0) { pr_info("Legacy rfkill issues, try rfkill2\n"); err = hp_wmi_rfkill2_setup(device); if (err)pr_warn("rfkill2_setup fail:%d\n", err); }
-	err = fourzone_setup(device); if (err)pr_err("Fail FourZone setup:%d\n", err);
-	err = hp_wmi_hwmon_init(); if (err)pr_err("Fail HWMON init:%d\n", err);
-	err = thermal_profile_setup(); if (err)pr_err("Fail thermal profile setup:%d\n", err);
+/*
+ * Probe is asynchronous. One discovery pass asks the BIOS what it supports,
+ * then the independent sub-features register in parallel. Their BIOS calls
+ * still serialise in the dispatcher, but sysfs, LED, rfkill and hwmon
+ * registration overlap. This shortens probe, not module load: do_init_module()
+ * waits for all async work unless the module is loaded with async_probe.
+ */
+static void hp_wmi_discover(void)
+{
+	bitmap_zero(hp_wmi_caps, HPWMI_CAP_MAX);
+	/* The value stays in the read cache for rfkill setup */
+	if (hp_wmi_read_int(HPWMI_WIRELESS_QUERY) >= 0)
+		set_bit(HPWMI_CAP_WIRELESS, hp_wmi_caps);
+	if (hp_wmi_board_may(HPWMI_BOARD_FOURZONE)) {
+		scoped_guard(mutex, &fourzone_lock)
+			if (!fourzone_shadow_sync())
+				set_bit(HPWMI_CAP_FOURZONE, hp_wmi_caps);
+		if (test_bit(HPWMI_CAP_FOURZONE, hp_wmi_caps) &&
+		    !hp_wmi_perform_query(HPWMI_FOURZONE_ANIM_GET, HPWMI_FOURZONE, NULL, 0, FOURZONE_BLOCK_SIZE))
+			set_bit(HPWMI_CAP_FOURZONE_ANIM, hp_wmi_caps);
+	}
+	if (hp_wmi_read_int(HPWMI_ALS_QUERY) >= 0)
+		set_bit(HPWMI_CAP_ALS, hp_wmi_caps);
+	if (hp_wmi_read_int(HPWMI_HDDTEMP_QUERY) >= 0)
+		set_bit(HPWMI_CAP_HDDTEMP, hp_wmi_caps);
+	hp_wmi_fan_probe();
+	hp_wmi_power_probe();
+	hp_wmi_profile_boot = hp_wmi_profile_raw();
+	if (hp_wmi_profile_boot >= 0)
+		set_bit(HPWMI_CAP_THERMAL, hp_wmi_caps);
+	pr_debug("caps:%*pb fans:%d\n", HPWMI_CAP_MAX, hp_wmi_caps, hp_wmi_fan_count);
+}
+
+static void hp_wmi_rfkill_setup_async(void *data, async_cookie_t cookie)
+{
+	struct platform_device *device = data;
+	int err;
+
+	if (test_bit(HPWMI_CAP_WIRELESS, hp_wmi_caps)) {
+		if (!hp_wmi_rfkill_setup(device))
+			return;
+		pr_info("Legacy rfkill issues, try rfkill2\n");
+	}
+	err = hp_wmi_rfkill2_setup(device);
+	if (err)
+		pr_warn("rfkill2_setup fail:%d\n", err);
+}
+
+static void hp_wmi_fourzone_setup_async(void *data, async_cookie_t cookie)
+{
+	int err = fourzone_setup(data);
+
+	if (err)
+		pr_err("Fail FourZone setup:%d\n", err);
+}
+
+static void hp_wmi_hwmon_setup_async(void *data, async_cookie_t cookie)
+{
+	int err = hp_wmi_hwmon_init();
+
+	if (err)
+		pr_err("Fail HWMON init:%d\n", err);
+}
+
+static void hp_wmi_profile_setup_async(void *data, async_cookie_t cookie)
+{
+	int err = thermal_profile_setup();
+
+	if (err)
+		pr_err("Fail thermal profile setup:%d\n", err);
+}
+static int hp_wmi_bios_setup(struct platform_device *device) {
+	wifi_rfkill = NULL; bluetooth_rfkill = NULL; wwan_rfkill = NULL; rfkill2_count = 0;
+	hp_wmi_discover();
+	async_schedule_domain(hp_wmi_rfkill_setup_async, device, &hp_wmi_async_domain);
+	if (test_bit(HPWMI_CAP_FOURZONE, hp_wmi_caps)) async_schedule_domain(hp_wmi_fourzone_setup_async, device, &hp_wmi_async_domain);
+	async_schedule_domain(hp_wmi_hwmon_setup_async, device, &hp_wmi_async_domain);
+	async_schedule_domain(hp_wmi_profile_setup_async, device, &hp_wmi_async_domain);
+	async_synchronize_full_domain(&hp_wmi_async_domain);
+	hp_wmi_power_setup(device);
+	hp_wmi_iio_setup(device);
+	hp_wmi_ctl_init();
 	return 0;
 }
+/*
+ * Resume only drops the read cache; the BIOS traffic runs from a work item
+ * off the resume path. The profile in effect at suspend and the user-set
+ * power limits, fan mode and lighting are put back first where the firmware
+ * lost them, then dock, tablet and rfkill state are refreshed with one
+ * hardware and one wireless read.
+ */
+static void hp_wmi_resume_work_fn(struct work_struct *work)
+{
+	if (hp_wmi_profile_restore() && platform_profile_dev)
+		platform_profile_notify(platform_profile_dev);
+	hp_wmi_power_restore();
+	hp_wmi_fan_restore();
+	fourzone_resume();
+	hp_wmi_dock_refresh();
+	hp_wmi_dock_attrs_changed();
+	hp_wmi_rfkill_refresh();
+	hp_wmi_profile_kick();
+}
+static DECLARE_WORK(hp_wmi_resume_work, hp_wmi_resume_work_fn);
 static void __exit hp_wmi_bios_remove(struct platform_device *device) {
-	int i; fourzone_remove(device);
-	if (platform_profile_support && platform_profile_dev) { platform_profile_remove(platform_profile_dev); platform_profile_support = false; platform_profile_dev = NULL; }
-	for (i = 0; i < rfkill2_count; i++) {
+	struct rfkill *legacy[3]; int i, n; hp_wmi_ctl_exit(); cancel_work_sync(&hp_wmi_resume_work); fourzone_remove(device); if (hp_power_registered) { sysfs_remove_group(&device->dev.kobj, &hp_power_group); hp_power_registered = false; } if (hp_gov_registered) { hp_gov_enable(false); sysfs_remove_group(&device->dev.kobj, &hp_gov_group); hp_gov_registered = false; } cancel_delayed_work_sync(&hp_gov_work); hp_wmi_watch_stop(); hp_wmi_fan_stop();
+	if (platform_profile_dev) { platform_profile_remove(platform_profile_dev); platform_profile_dev = NULL; }
+	/* Hide the radios from the event worker, which outlives us, before they go away */
+	n = rfkill2_count; legacy[0] = wifi_rfkill; legacy[1] = bluetooth_rfkill; legacy[2] = wwan_rfkill;
+	WRITE_ONCE(rfkill2_count, 0); WRITE_ONCE(wifi_rfkill, NULL); WRITE_ONCE(bluetooth_rfkill, NULL); WRITE_ONCE(wwan_rfkill, NULL);
+	flush_work(&hp_wmi_event_work);
+	for (i = 0; i < n; i++) {
 		if (rfkill2[i].rfkill) {
 			rfkill_unregister(rfkill2[i].rfkill);
 			rfkill_destroy(rfkill2[i].rfkill);
 			rfkill2[i].rfkill = NULL;
 		}
 	}
-	rfkill2_count = 0; // To jest OK, jeśli for był pusty
-	if (wifi_rfkill) { rfkill_unregister(wifi_rfkill); rfkill_destroy(wifi_rfkill); wifi_rfkill = NULL; }
-	if (bluetooth_rfkill) { rfkill_unregister(bluetooth_rfkill); rfkill_destroy(bluetooth_rfkill); bluetooth_rfkill = NULL; }
-	if (wwan_rfkill) { rfkill_unregister(wwan_rfkill); rfkill_destroy(wwan_rfkill); wwan_rfkill = NULL; }
+	for (i = 0; i < ARRAY_SIZE(legacy); i++)
+		if (legacy[i]) { rfkill_unregister(legacy[i]); rfkill_destroy(legacy[i]); }
 }
-static int hp_wmi_resume_handler(struct device *d) {
-	int ds, ts; if (hp_wmi_input_dev) { if (test_bit(SW_DOCK, hp_wmi_input_dev->swbit)) { ds = hp_wmi_get_dock_state(); if (ds >= 0)input_report_switch(hp_wmi_input_dev, SW_DOCK, ds); } if (test_bit(SW_TABLET_MODE, hp_wmi_input_dev->swbit) && enable_tablet_mode_sw != 0) { ts = hp_wmi_get_tablet_mode(); if (ts >= 0)input_report_switch(hp_wmi_input_dev, SW_TABLET_MODE, ts); } input_sync(hp_wmi_input_dev); }
-	if (rfkill2_count)hp_wmi_rfkill2_refresh(); else { if (wifi_rfkill)rfkill_set_states(wifi_rfkill, hp_wmi_get_sw_state(HPWMI_WIFI), hp_wmi_get_hw_state(HPWMI_WIFI)); if (bluetooth_rfkill)rfkill_set_states(bluetooth_rfkill, hp_wmi_get_sw_state(HPWMI_BLUETOOTH), hp_wmi_get_hw_state(HPWMI_BLUETOOTH)); if (wwan_rfkill)rfkill_set_states(wwan_rfkill, hp_wmi_get_sw_state(HPWMI_WWAN), hp_wmi_get_hw_state(HPWMI_WWAN)); }
+static int hp_wmi_suspend_handler(struct device *d)
+{
+	hp_wmi_profile_save();
 	return 0;
 }
-static const struct dev_pm_ops hp_wmi_pm_ops = { .resume = hp_wmi_resume_handler, .restore = hp_wmi_resume_handler };
-static struct platform_driver hp_wmi_driver = { .driver = {.name = "hp-wmi", .pm = &hp_wmi_pm_ops, .dev_groups = hp_wmi_groups}, .probe = hp_wmi_bios_setup, .remove = __exit_p(hp_wmi_bios_remove) };
+static int hp_wmi_resume_handler(struct device *d) {
+	hp_wmi_cache_invalidate_all(); queue_work(system_wq, &hp_wmi_resume_work); return 0;
+}
+static const struct dev_pm_ops hp_wmi_pm_ops = { .suspend = hp_wmi_suspend_handler, .resume = hp_wmi_resume_handler, .freeze = hp_wmi_suspend_handler, .restore = hp_wmi_resume_handler };
+static struct platform_driver hp_wmi_driver = { .driver = {.name = "hp-wmi", .pm = &hp_wmi_pm_ops, .dev_groups = hp_wmi_groups, .probe_type = PROBE_PREFER_ASYNCHRONOUS}, .probe = hp_wmi_bios_setup, .remove = __exit_p(hp_wmi_bios_remove) };
 static umode_t hp_wmi_hwmon_is_visible(const void *drvdata, enum hwmon_sensor_types type, u32 attr, int channel) {
-	switch (type) { case hwmon_pwm:if (attr == hwmon_pwm_enable)return 0644; break; case hwmon_fan:if (attr == hwmon_fan_input)if (hp_wmi_get_fan_speed(channel) >= 0)return 0444; break; default:break; } return 0;
+	switch (type) { case hwmon_chip: return hp_wmi_fan_count ? 0644 : 0; case hwmon_pwm:if (attr == hwmon_pwm_enable)return channel == 0 ? 0644 : 0; return channel < hp_wmi_fan_count ? 0644 : 0; case hwmon_fan: return channel < hp_wmi_fan_count ? 0444 : 0; default:break; } return 0;
 }
 static int hp_wmi_hwmon_read(struct device *d, enum hwmon_sensor_types type, u32 attr, int channel, long *val) {
-	int r; switch (type) { case hwmon_fan:if (attr == hwmon_fan_input) { r = hp_wmi_get_fan_speed(channel); if (r < 0)return r; *val = r; return 0; } break; case hwmon_pwm:if (attr == hwmon_pwm_enable) { r = hp_wmi_fan_speed_max_get(); if (r < 0)return r; if (r == 0)*val = 2; else if (r == 1)*val = 0; else return -ENODATA; return 0; } break; default:break; } return -EOPNOTSUPP;
+	int r; switch (type) { case hwmon_chip:if (attr == hwmon_chip_update_interval) { *val = READ_ONCE(hp_wmi_fan_interval_ms); return 0; } break; case hwmon_fan:if (attr == hwmon_fan_input)return hp_wmi_fan_cached(channel, val); break; case hwmon_pwm:if (attr == hwmon_pwm_input)return hp_wmi_fan_pwm_get(channel, val); if (attr == hwmon_pwm_enable) { r = READ_ONCE(hp_wmi_fan_mode); if (r == HPWMI_FAN_MODE_MANUAL || r == HPWMI_FAN_MODE_CURVE) { *val = r; return 0; } r = hp_wmi_fan_speed_max_get(); if (r < 0)return r; if (r == 0)*val = 2; else if (r == 1)*val = 0; else return -ENODATA; return 0; } break; default:break; } return -EOPNOTSUPP;
+}
+static int hp_wmi_hwmon_read_string(struct device *d, enum hwmon_sensor_types type, u32 attr, int channel, const char **str) {
+	if (type == hwmon_fan && attr == hwmon_fan_label) { *str = hp_wmi_fan_labels[channel]; return 0; } return -EOPNOTSUPP;
 }
 static int hp_wmi_hwmon_write(struct device *d, enum hwmon_sensor_types type, u32 attr, int channel, long val) {
-	if (type == hwmon_pwm && attr == hwmon_pwm_enable) { if (val == 2)return hp_wmi_fan_speed_max_set(0); if (val == 0)return hp_wmi_fan_speed_max_set(1); return -EINVAL; } return -EOPNOTSUPP;
+	guard(rwsem_read)(&hp_wmi_ctl_rwsem);
+	if (type == hwmon_chip && attr == hwmon_chip_update_interval) { WRITE_ONCE(hp_wmi_fan_interval_ms, clamp_val(val, 100, 60000)); hp_wmi_fan_rearm(0); return 0; }
+	if (type == hwmon_pwm && attr == hwmon_pwm_input)return hp_wmi_fan_pwm_set(channel, val);
+	if (type == hwmon_pwm && attr == hwmon_pwm_enable) { if (val < HPWMI_FAN_MODE_FULL || val > HPWMI_FAN_MODE_CURVE)return -EINVAL; return hp_wmi_fan_mode_set(val); } return -EOPNOTSUPP;
 }
-static const struct hwmon_channel_info * const hp_wmi_hwmon_info[] = { HWMON_CHANNEL_INFO(fan, HWMON_F_INPUT), HWMON_CHANNEL_INFO(pwm, HWMON_PWM_ENABLE), NULL};
-static const struct hwmon_ops hp_wmi_hwmon_ops = {.is_visible = hp_wmi_hwmon_is_visible, .read = hp_wmi_hwmon_read, .write = hp_wmi_hwmon_write};
+static const struct hwmon_channel_info * const hp_wmi_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+	HWMON_CHANNEL_INFO(fan, HWMON_F_INPUT | HWMON_F_LABEL, HWMON_F_INPUT | HWMON_F_LABEL, HWMON_F_INPUT | HWMON_F_LABEL, HWMON_F_INPUT | HWMON_F_LABEL),
+	/* One fan mode for every fan, so only pwm1_enable */
+	HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT | HWMON_PWM_ENABLE, HWMON_PWM_INPUT, HWMON_PWM_INPUT, HWMON_PWM_INPUT), NULL};
+static const struct hwmon_ops hp_wmi_hwmon_ops = {.is_visible = hp_wmi_hwmon_is_visible, .read = hp_wmi_hwmon_read, .read_string = hp_wmi_hwmon_read_string, .write = hp_wmi_hwmon_write};
 static const struct hwmon_chip_info hp_wmi_hwmon_chip_info = {.ops = &hp_wmi_hwmon_ops, .info = hp_wmi_hwmon_info};
 static int hp_wmi_hwmon_init(void) {
 	struct device *hd; if (!hp_wmi_platform_dev) { pr_err("HWMON:hp_wmi_platform_dev NULL\n"); return -ENODEV; }
-	hd = devm_hwmon_device_register_with_info(&hp_wmi_platform_dev->dev, "hp_wmi", NULL, &hp_wmi_hwmon_chip_info, NULL);
+	/* A rebind after remove starts with working fan works again */
+	scoped_guard(mutex, &hp_wmi_fan_curve_lock)
+		scoped_guard(mutex, &hp_wmi_fan_lock)
+			hp_wmi_fan_stopping = false;
+	hd = devm_hwmon_device_register_with_info(&hp_wmi_platform_dev->dev, "hp_wmi", NULL, &hp_wmi_hwmon_chip_info, hp_wmi_fan_curve_setup(&hp_wmi_platform_dev->dev));
 	if (IS_ERR(hd)) { pr_err("Fail register hp_wmi hwmon:%ld\n", PTR_ERR(hd)); return PTR_ERR(hd); } return 0;
 }
+/*
+ * The hotkey input device needs several BIOS queries. Running them in their
+ * own domain lets them overlap with the platform device probe.
+ */
+static void hp_wmi_input_setup_async(void *data, async_cookie_t cookie)
+{
+	int err = hp_wmi_input_setup();
+
+	if (err)
+		pr_err("HP WMI input setup fail:%d\n", err);
+}
 static int __init hp_wmi_init(void) {
-	int err; bool ec = wmi_has_guid(HPWMI_EVENT_GUID), bc = wmi_has_guid(HPWMI_BIOS_GUID);
+	int err; bool ec = emulate || wmi_has_guid(HPWMI_EVENT_GUID), bc = emulate || wmi_has_guid(HPWMI_BIOS_GUID);
 	if (!ec && !bc) { pr_info("No HP WMI interface\n"); return -ENODEV; }
-	if (ec) { err = hp_wmi_input_setup(); if (err) { pr_err("HP WMI input setup fail:%d\n", err); return err; } }
+	if (emulate) { hp_wmi_transport = &hp_wmi_emul_transport; pr_info("Using emulated HP BIOS\n"); }
+	hp_wmi_board = hp_wmi_board_lookup(); if (hp_wmi_board) pr_debug("Board %s flags:0x%x fans:%u\n", hp_wmi_board->name, hp_wmi_board->flags, hp_wmi_board->fans);
+	hp_wmi_debugfs_init(); hp_wmi_emul_debugfs_init();
+	if (ec) { async_schedule_domain(hp_wmi_input_setup_async, NULL, &hp_wmi_input_async_domain); hp_wmi_evdev_init(); }
 	if (bc) { hp_wmi_platform_dev = platform_device_register_simple("hp-wmi", -1, NULL, 0); if (IS_ERR(hp_wmi_platform_dev)) { err = PTR_ERR(hp_wmi_platform_dev); pr_err("Fail register hp-wmi pdev:%d\n", err); goto err_destroy_input; }
 		err = platform_driver_register(&hp_wmi_driver); if (err) { pr_err("Fail register hp-wmi pdrv:%d\n", err); goto err_unregister_pdev; }
 	} pr_info("HP WMI driver init (evt:%d,bios:%d)\n", ec, bc); return 0;
-err_unregister_pdev: platform_device_unregister(hp_wmi_platform_dev); hp_wmi_platform_dev = NULL;
-err_destroy_input: if (ec)hp_wmi_input_destroy(); if (camera_shutter_input_dev) { input_unregister_device(camera_shutter_input_dev); camera_shutter_input_dev = NULL; } return err;
+err_unregister_pdev: async_synchronize_full_domain(&hp_wmi_async_domain); async_synchronize_full_domain(&hp_wmi_input_async_domain); if (ec) hp_wmi_input_destroy(); platform_device_unregister(hp_wmi_platform_dev); hp_wmi_platform_dev = NULL;
+err_destroy_input: async_synchronize_full_domain(&hp_wmi_input_async_domain); if (ec) { hp_wmi_input_destroy(); hp_wmi_evdev_exit(); } if (camera_shutter_input_dev) { input_unregister_device(camera_shutter_input_dev); camera_shutter_input_dev = NULL; } debugfs_remove_recursive(hp_wmi_debugfs); return err;
 }
 module_init(hp_wmi_init);
 static void __exit hp_wmi_exit(void) {
-	if (wmi_has_guid(HPWMI_BIOS_GUID) && hp_wmi_platform_dev) { platform_driver_unregister(&hp_wmi_driver); platform_device_unregister(hp_wmi_platform_dev); hp_wmi_platform_dev = NULL; }
-	if (wmi_has_guid(HPWMI_EVENT_GUID)) { hp_wmi_input_destroy(); if (camera_shutter_input_dev) { input_unregister_device(camera_shutter_input_dev); camera_shutter_input_dev = NULL; } }
+	bool ec = emulate || wmi_has_guid(HPWMI_EVENT_GUID);
+
+	async_synchronize_full_domain(&hp_wmi_async_domain);
+	async_synchronize_full_domain(&hp_wmi_input_async_domain);
+	/* No events, and no event work touching the platform device, once it goes */
+	if (ec) hp_wmi_input_destroy();
+	if ((emulate || wmi_has_guid(HPWMI_BIOS_GUID)) && hp_wmi_platform_dev) { platform_driver_unregister(&hp_wmi_driver); platform_device_unregister(hp_wmi_platform_dev); hp_wmi_platform_dev = NULL; }
+	if (ec) { hp_wmi_evdev_exit(); if (camera_shutter_input_dev) { input_unregister_device(camera_shutter_input_dev); camera_shutter_input_dev = NULL; } }
+	debugfs_remove_recursive(hp_wmi_debugfs);
 	pr_info("HP WMI driver unloaded\n");
 }
-module_exit(hp_wmi_exit);
\ No newline at end of file
+module_exit(hp_wmi_exit);
+#if IS_ENABLED(CONFIG_HP_WMI_KUNIT_TEST)
+#include "hp-wmi-test.c"
+#endif